@@ -0,0 +1,105 @@
+// Just enough of the Arduino core to build the Ethernet library on a
+// host.  Time is simulated: millis() only moves when delay() is called
+// or a test advances it.
+
+#ifndef ARDUINO_H_HOST
+#define ARDUINO_H_HOST
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define ARDUINO 10800
+#define F(s) (s)
+#define OUTPUT 1
+#define LOW 0
+#define HIGH 1
+#define SS 10
+
+typedef bool boolean;
+typedef uint8_t byte;
+
+unsigned long millis();
+unsigned long micros();
+void delay(unsigned long ms);
+void delayMicroseconds(unsigned int us);
+void yield();
+long random(long howsmall, long howbig);
+void pinMode(uint8_t pin, uint8_t mode);
+void digitalWrite(uint8_t pin, uint8_t val);
+uint16_t word(uint8_t h, uint8_t l);
+
+class Print {
+public:
+	virtual size_t write(uint8_t) = 0;
+	virtual size_t write(const uint8_t *buf, size_t size) {
+		size_t n = 0;
+		while (size--) n += write(*buf++);
+		return n;
+	}
+	size_t write(const char *str) {
+		return str ? write((const uint8_t *)str, strlen(str)) : 0;
+	}
+	size_t print(const char *str) { return write(str); }
+	virtual void flush() { }
+	int getWriteError() { return write_error; }
+	void clearWriteError() { write_error = 0; }
+protected:
+	void setWriteError(int err = 1) { write_error = err; }
+private:
+	int write_error = 0;
+};
+
+class Stream : public Print {
+public:
+	virtual int available() = 0;
+	virtual int read() = 0;
+	virtual int peek() = 0;
+};
+
+class IPAddress {
+public:
+	IPAddress() { _address.dword = 0; }
+	IPAddress(uint8_t a, uint8_t b, uint8_t c, uint8_t d) {
+		_address.bytes[0] = a;
+		_address.bytes[1] = b;
+		_address.bytes[2] = c;
+		_address.bytes[3] = d;
+	}
+	IPAddress(uint32_t address) { _address.dword = address; }
+	// uint32_t is unsigned long on the boards, but not on a 64 bit host
+	IPAddress(unsigned long address) { _address.dword = address; }
+	IPAddress(const uint8_t *address) { memcpy(_address.bytes, address, 4); }
+	bool fromString(const char *) { return false; }
+	operator uint32_t() const { return _address.dword; }
+	bool operator==(const IPAddress &addr) const { return _address.dword == addr._address.dword; }
+	bool operator!=(const IPAddress &addr) const { return !(*this == addr); }
+	bool operator==(const uint8_t *addr) const { return memcmp(addr, _address.bytes, 4) == 0; }
+	uint8_t operator[](int index) const { return _address.bytes[index]; }
+	uint8_t &operator[](int index) { return _address.bytes[index]; }
+	IPAddress &operator=(const uint8_t *address) {
+		memcpy(_address.bytes, address, 4);
+		return *this;
+	}
+	IPAddress &operator=(uint32_t address) {
+		_address.dword = address;
+		return *this;
+	}
+	friend class EthernetClass;
+	friend class UDP;
+	friend class Client;
+	friend class Server;
+	friend class DhcpClass;
+	friend class DNSClient;
+private:
+	union {
+		uint8_t bytes[4];
+		uint32_t dword;
+	} _address;
+	uint8_t *raw_address() { return _address.bytes; }
+};
+
+extern const IPAddress INADDR_NONE;
+
+#endif
@@ -0,0 +1,28 @@
+#ifndef SPI_H_HOST
+#define SPI_H_HOST
+
+#include <Arduino.h>
+
+#define MSBFIRST 1
+#define SPI_MODE0 0
+#define SPI_HAS_TRANSFER_BUF
+
+struct SPISettings {
+	SPISettings(uint32_t, uint8_t, uint8_t) { }
+};
+
+// Nothing is connected: the library reaches the chip model through
+// W5100.setBus() instead
+class SPIClass {
+public:
+	void begin() { }
+	void beginTransaction(SPISettings) { }
+	void endTransaction() { }
+	uint8_t transfer(uint8_t) { return 0; }
+	void transfer(void *, size_t) { }
+	void transfer(const void *, void *, size_t) { }
+};
+
+extern SPIClass SPI;
+
+#endif
@@ -0,0 +1,11 @@
+#ifndef SERVER_H_HOST
+#define SERVER_H_HOST
+
+#include <Arduino.h>
+
+class Server : public Print {
+public:
+	virtual void begin() = 0;
+};
+
+#endif
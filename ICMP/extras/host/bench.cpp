@@ -0,0 +1,111 @@
+// A/B benchmark of bus transports.  The same workloads run over the
+// chip model with whole-buffer transfers, and again with every transfer
+// split into single bytes like an SPI port without buffer transfers.
+// Nothing in the library changes between the two runs.
+
+#include <stdio.h>
+#include <time.h>
+#include "host.h"
+
+class BenchBus : public EthernetBus {
+public:
+	BenchBus(const char *name, bool bytewise) : name(name), bytewise(bytewise) { }
+	virtual void beginTransaction() { transactions++; }
+	virtual void select() { model.select(); }
+	virtual void transfer(const uint8_t *txbuf, uint8_t *rxbuf, uint16_t len) {
+		if (!bytewise) {
+			calls++;
+			model.transfer(txbuf, rxbuf, len);
+			return;
+		}
+		for (uint16_t i=0; i < len; i++) {
+			calls++;
+			model.transfer(txbuf ? txbuf + i : NULL, rxbuf ? rxbuf + i : NULL, 1);
+		}
+	}
+	virtual void deselect() { model.deselect(); }
+
+	const char *name;
+	bool bytewise;
+	uint32_t transactions;
+	uint32_t calls;
+};
+
+static BenchBus block("block", false);
+static BenchBus bytewise("bytewise", true);
+
+static uint64_t nanos()
+{
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return (uint64_t)t.tv_sec * 1000000000 + t.tv_nsec;
+}
+
+// 500 small datagrams received and echoed
+static void udp_echo()
+{
+	EthernetUDP udp;
+	uint8_t buf[64];
+
+	udp.begin(7);
+	uint8_t s = udp.getSocketNumber();
+	memset(buf, 'u', sizeof(buf));
+	for (int i=0; i < 500; i++) {
+		host_udp(s, IPAddress(10, 0, 0, 9), 1234, buf, 48);
+		int len = udp.parsePacket();
+		udp.read(buf, len);
+		udp.beginPacket(udp.remoteIP(), udp.remotePort());
+		udp.write(buf, len);
+		udp.endPacket();
+		model.drain(s, buf, sizeof(buf));
+	}
+	udp.stop();
+}
+
+// 32 kB received on a TCP connection and parsed a byte at a time, then
+// 32 kB sent in 64 byte writes
+static void tcp_stream()
+{
+	EthernetClient client;
+	uint8_t buf[1024];
+
+	client.connect(IPAddress(10, 0, 0, 5), 80);
+	uint8_t s = client.getSocketNumber();
+	memset(buf, 't', sizeof(buf));
+	for (int i=0; i < 32; i++) {
+		model.inject(s, buf, sizeof(buf));
+		while (client.available()) client.read();
+	}
+	for (int i=0; i < 512; i++) {
+		client.write(buf, 64);
+		model.drain(s, buf, sizeof(buf));
+	}
+	client.stop();
+}
+
+static void run(const char *workload, void (*fn)(), BenchBus &bus)
+{
+	W5100.setBus(&bus);
+	bus.transactions = 0;
+	bus.calls = 0;
+	uint32_t frames = model.frames, bytes = model.bytes;
+	uint64_t t = nanos();
+	fn();
+	t = nanos() - t;
+	printf("%-12s %-9s %8u %8u %9u %9u %8u\n", workload, bus.name,
+		bus.transactions, model.frames - frames, model.bytes - bytes,
+		bus.calls, (unsigned)(t / 1000));
+	W5100.setBus(&model);
+}
+
+int main()
+{
+	host_begin();
+	printf("%-12s %-9s %8s %8s %9s %9s %8s\n", "workload", "bus",
+		"trans", "frames", "bytes", "calls", "host_us");
+	run("udp_echo", udp_echo, block);
+	run("udp_echo", udp_echo, bytewise);
+	run("tcp_stream", tcp_stream, block);
+	run("tcp_stream", tcp_stream, bytewise);
+	return 0;
+}
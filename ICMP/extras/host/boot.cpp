@@ -0,0 +1,57 @@
+// Boot time with fast start, for a chip which only answers once it
+// comes out of reset after the given number of milliseconds.  Prints
+// the time Ethernet.init() took and the time until the first UDP
+// datagram was sent, and fails if init() waited longer than the 560 ms
+// a reset pulse can last.
+
+#include <stdio.h>
+#include "host.h"
+
+static unsigned long ready_ms;
+
+// The chip model, reading as all zeros while held in reset
+class ResetBus : public EthernetBus {
+public:
+	virtual void select() { if (millis() >= ready_ms) model.select(); }
+	virtual void transfer(const uint8_t *txbuf, uint8_t *rxbuf, uint16_t len) {
+		if (millis() >= ready_ms) {
+			model.transfer(txbuf, rxbuf, len);
+		} else if (rxbuf) {
+			memset(rxbuf, 0, len);
+		}
+	}
+	virtual void deselect() { if (millis() >= ready_ms) model.deselect(); }
+};
+
+static ResetBus bus;
+
+int main(int argc, char **argv)
+{
+	static const uint8_t mac[6] = {0x02, 0x00, 0x00, 0x00, 0x00, 0x01};
+
+	ready_ms = argc > 1 ? atol(argv[1]) : 0;
+	W5100.setBus(&bus);
+	Ethernet.init(10, true);
+	uint16_t init_ms = Ethernet.initTime();
+	bool found = Ethernet.hardwareStatus() != EthernetNoHardware;
+	if (init_ms > 560) {
+		printf("reset %5lu ms: init took %u ms\n", ready_ms, init_ms);
+		return 1;
+	}
+	// begin() tries again if the chip wasn't found in time
+	Ethernet.begin((uint8_t *)mac, IPAddress(10, 0, 0, 2));
+
+	EthernetUDP udp;
+	uint8_t buf[8];
+	udp.begin(8888);
+	udp.beginPacket(IPAddress(10, 0, 0, 9), 8888);
+	udp.write((const uint8_t *)"ready", 5);
+	udp.endPacket();
+	if (model.drain(udp.getSocketNumber(), buf, sizeof(buf)) != 5) {
+		printf("reset %5lu ms: first packet not sent\n", ready_ms);
+		return 1;
+	}
+	printf("reset %5lu ms: init %3u ms (%s), first packet at %4lu ms\n",
+		ready_ms, init_ms, found ? "found" : "not found", millis());
+	return 0;
+}
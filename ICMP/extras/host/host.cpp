@@ -0,0 +1,47 @@
+#include <stdio.h>
+#include <SPI.h>
+#include "host.h"
+
+SPIClass SPI;
+const IPAddress INADDR_NONE(0, 0, 0, 0);
+EthernetModelBus model;
+unsigned long host_ms;
+
+unsigned long millis() { return host_ms; }
+unsigned long micros() { return host_ms * 1000; }
+void delay(unsigned long ms) { host_ms += ms; }
+void delayMicroseconds(unsigned int) { }
+// Busy loops in the library yield while they wait, so let time pass
+void yield() { host_ms++; }
+long random(long howsmall, long) { return howsmall; }
+void pinMode(uint8_t, uint8_t) { }
+void digitalWrite(uint8_t, uint8_t) { }
+uint16_t word(uint8_t h, uint8_t l) { return (h << 8) | l; }
+
+void host_begin()
+{
+	static const uint8_t mac[6] = {0x02, 0x00, 0x00, 0x00, 0x00, 0x01};
+
+	W5100.setBus(&model);
+	Ethernet.begin((uint8_t *)mac, IPAddress(10, 0, 0, 2));
+	if (Ethernet.hardwareStatus() != EthernetW5500) {
+		printf("chip model not detected\n");
+		exit(2);
+	}
+}
+
+void host_udp(uint8_t s, IPAddress ip, uint16_t port, const void *data, uint16_t len)
+{
+	uint8_t buf[8 + 1472];
+
+	buf[0] = ip[0];
+	buf[1] = ip[1];
+	buf[2] = ip[2];
+	buf[3] = ip[3];
+	buf[4] = port >> 8;
+	buf[5] = port;
+	buf[6] = len >> 8;
+	buf[7] = len;
+	memcpy(buf + 8, data, len);
+	model.inject(s, buf, len + 8);
+}
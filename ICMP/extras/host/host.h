@@ -0,0 +1,21 @@
+// Host build of the Ethernet library against the W5500 chip model
+// (EthernetModelBus), for regression tests and benchmarks on Linux.
+
+#ifndef HOST_H_INCLUDED
+#define HOST_H_INCLUDED
+
+#include <Arduino.h>
+#include "Ethernet.h"
+#include "w5100.h"
+
+extern EthernetModelBus model;
+
+// The simulated clock behind millis().  delay() and yield() advance it.
+extern unsigned long host_ms;
+
+// Attach the chip model and bring up Ethernet with a static address
+void host_begin();
+// Queue a UDP datagram for socket s, with the chip's 8 byte header
+void host_udp(uint8_t s, IPAddress ip, uint16_t port, const void *data, uint16_t len);
+
+#endif
@@ -0,0 +1,853 @@
+// Regression tests, run against the chip model by "make check"
+
+#include <stdio.h>
+#include "host.h"
+#include "socket.h"
+
+static int failures;
+
+#define CHECK(cond) do { \
+	if (!(cond)) { \
+		printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+		failures++; \
+	} \
+} while (0)
+
+// A datagram looked at where it sits in the RX buffer: peeked at
+// anywhere ahead of the cursor, and skipped without copying
+static void test_udp_in_place()
+{
+	EthernetUDP udp;
+	uint8_t buf[16];
+	const char *msg = "0123456789abcdefghijklmnopqrstuvwxyzABCD";
+
+	CHECK(udp.begin(18));
+	uint8_t s = udp.getSocketNumber();
+	host_udp(s, IPAddress(10, 0, 0, 9), 1234, msg, 40);
+	host_udp(s, IPAddress(10, 0, 0, 9), 1234, "next", 4);
+	CHECK(udp.parsePacket() == 40);
+	CHECK(udp.packetLength() == 40);
+	CHECK(udp.peek(10, buf, 5) == 5);
+	CHECK(memcmp(buf, msg + 10, 5) == 0);
+	CHECK(udp.position() == 0);
+	uint32_t bytes = model.bytes;
+	CHECK(udp.skip(30) == 30);
+	CHECK(model.bytes - bytes < 30); // no payload transferred
+	CHECK(udp.position() == 30);
+	CHECK(udp.peek(5, buf, 10) == 5); // clipped to the datagram
+	CHECK(memcmp(buf, msg + 35, 5) == 0);
+	CHECK(udp.read(buf, sizeof(buf)) == 10);
+	CHECK(memcmp(buf, msg + 30, 10) == 0);
+	CHECK(udp.parsePacket() == 4);
+	CHECK(udp.read(buf, sizeof(buf)) == 4);
+	CHECK(memcmp(buf, "next", 4) == 0);
+	udp.stop();
+}
+
+// A datagram in, and the reply out again
+static void test_udp_echo()
+{
+	EthernetUDP udp;
+	uint8_t buf[16];
+
+	CHECK(udp.begin(7));
+	host_udp(udp.getSocketNumber(), IPAddress(10, 0, 0, 9), 1234, "hello", 5);
+	CHECK(udp.parsePacket() == 5);
+	CHECK(udp.remoteIP() == IPAddress(10, 0, 0, 9));
+	CHECK(udp.remotePort() == 1234);
+	CHECK(udp.read(buf, sizeof(buf)) == 5);
+	CHECK(memcmp(buf, "hello", 5) == 0);
+	CHECK(udp.parsePacket() == 0);
+
+	CHECK(udp.beginPacket(udp.remoteIP(), udp.remotePort()));
+	udp.write(buf, 5);
+	CHECK(udp.endPacket());
+	CHECK(model.drain(udp.getSocketNumber(), buf, sizeof(buf)) == 5);
+	CHECK(memcmp(buf, "hello", 5) == 0);
+	udp.stop();
+}
+
+// A socket's status snapshot is one burst while TX_FSR is unchanged
+static void test_status_snapshot()
+{
+	EthernetUDP udp;
+	EthernetSocketEvents events[MAX_SOCK_NUM];
+
+	CHECK(udp.begin(9));
+	CHECK(Ethernet.poll(events) == 1);
+	uint32_t frames = model.frames;
+	CHECK(Ethernet.poll(events) == 1);
+	CHECK(model.frames - frames == 1);
+	udp.stop();
+}
+
+static void udp_send(EthernetUDP &udp, IPAddress ip, uint16_t port)
+{
+	uint8_t buf[8];
+
+	CHECK(udp.beginPacket(ip, port));
+	udp.write((const uint8_t *)"ping", 4);
+	CHECK(udp.endPacket());
+	CHECK(model.drain(udp.getSocketNumber(), buf, sizeof(buf)) == 4);
+}
+
+static bool dest_is(uint8_t s, IPAddress ip)
+{
+	uint8_t dipr[4];
+
+	W5100.beginTransaction();
+	W5100.readSnDIPR(s, dipr);
+	W5100.endTransaction();
+	return ip == dipr;
+}
+
+// An unchanged destination is not written again, even after the socket
+// is reopened, but the shadow is forgotten when a connecting client
+// changes the registers
+static void test_register_shadow()
+{
+	EthernetUDP udp;
+	IPAddress ip(10, 0, 0, 9);
+
+	CHECK(udp.begin(14));
+	uint8_t s = udp.getSocketNumber();
+	udp_send(udp, ip, 1234);
+	udp.stop();
+	CHECK(udp.begin(14));
+	CHECK(udp.getSocketNumber() == s);
+	uint32_t frames = model.frames;
+	CHECK(udp.beginPacket(ip, 1234));
+#ifndef ETHERNET_NO_REGISTER_SHADOW
+	CHECK(model.frames == frames);
+#endif
+	udp.write((const uint8_t *)"ping", 4);
+	CHECK(udp.endPacket());
+	CHECK(dest_is(s, ip));
+	udp.stop();
+
+	// the same socket listens, and a client connects from elsewhere
+	CHECK(Ethernet.socketReserve(s));
+	W5100.beginTransaction();
+	W5100.writeSnMR(s, SnMR::TCP);
+	W5100.writeSnPORT(s, 14);
+	W5100.execCmdSn(s, Sock_OPEN);
+	W5100.execCmdSn(s, Sock_LISTEN);
+	W5100.endTransaction();
+	CHECK(model.establish(s));
+	CHECK(!dest_is(s, ip));
+	W5100.beginTransaction();
+	W5100.execCmdSn(s, Sock_CLOSE);
+	W5100.endTransaction();
+	Ethernet.socketRelease(s);
+
+	CHECK(udp.begin(14));
+	CHECK(udp.getSocketNumber() == s);
+	udp_send(udp, ip, 1234);
+	CHECK(dest_is(s, ip));
+	udp.stop();
+}
+
+// A new destination is written in one frame, address and port together
+static void test_dest_burst()
+{
+	EthernetUDP udp;
+
+	CHECK(udp.begin(16));
+	uint8_t s = udp.getSocketNumber();
+	uint32_t frames = model.frames, bytes = model.bytes;
+	CHECK(udp.beginPacket(IPAddress(10, 0, 0, 31), 0x1234));
+	CHECK(model.frames - frames == 1);
+	CHECK(model.bytes - bytes == 3 + 6);
+	CHECK(dest_is(s, IPAddress(10, 0, 0, 31)));
+	W5100.beginTransaction();
+	uint16_t dport = W5100.readSnDPORT(s);
+	W5100.endTransaction();
+	CHECK(dport == 0x1234);
+	udp.stop();
+}
+
+// A header and payload gathered into the TX buffer, across its end,
+// with Sn_TX_WR read and written once
+static void test_gather_write()
+{
+	EthernetUDP udp;
+	static uint8_t fill[2048];
+	uint8_t head[8], body[20], out[32];
+
+	CHECK(udp.begin(17));
+	uint8_t s = udp.getSocketNumber();
+	uint16_t size = W5100.TXSIZE(s);
+	socket_iov_t iov[2] = { { fill, (uint16_t)(size - 5) }, { NULL, 0 } };
+	W5100.beginTransaction();
+	CHECK(write_datav(s, 0, iov, 1) == size - 5);
+	W5100.execCmdSn(s, Sock_SEND);
+	W5100.endTransaction();
+	CHECK(model.drain(s, fill, sizeof(fill)) == size - 5);
+
+	for (int i=0; i < 8; i++) head[i] = 0xA0 + i;
+	for (int i=0; i < 20; i++) body[i] = i;
+	iov[0].data = head;
+	iov[0].len = 8;
+	iov[1].data = body;
+	iov[1].len = 20;
+	uint32_t frames = model.frames;
+	W5100.beginTransaction();
+	CHECK(write_datav(s, 0, iov, 2) == 28);
+	CHECK(model.frames - frames == 4); // TX_WR read, 2 pieces, TX_WR write
+	W5100.execCmdSn(s, Sock_SEND);
+	W5100.endTransaction();
+	CHECK(model.drain(s, out, sizeof(out)) == 28);
+	CHECK(memcmp(out, head, 8) == 0 && memcmp(out + 8, body, 20) == 0);
+	udp.stop();
+}
+
+// A burst of datagrams in one call goes out whole and in order, for
+// fewer frames than sending them one by one
+static void test_udp_batch_send()
+{
+	EthernetUDP udp;
+	EthernetUDPPacket packets[20];
+	uint8_t data[20][10], out[256];
+
+	CHECK(udp.begin(19));
+	uint8_t s = udp.getSocketNumber();
+	for (int i=0; i < 20; i++) {
+		memset(data[i], 'a' + i, sizeof(data[i]));
+		packets[i].data = data[i];
+		packets[i].length = sizeof(data[i]);
+		packets[i].remoteIP = i < 10 ? IPAddress(10, 0, 0, 9) : IPAddress(10, 0, 0, 10);
+		packets[i].remotePort = 1234;
+	}
+	uint32_t frames = model.frames;
+	for (int i=0; i < 20; i++) {
+		udp.beginPacket(packets[i].remoteIP, packets[i].remotePort);
+		udp.write(packets[i].data, packets[i].length);
+		udp.endPacket();
+	}
+	uint32_t single = model.frames - frames;
+	CHECK(model.drain(s, out, sizeof(out)) == 200);
+
+	frames = model.frames;
+	CHECK(udp.sendPackets(packets, 20) == 20);
+	CHECK(model.frames - frames < single);
+	CHECK(model.drain(s, out, sizeof(out)) == 200);
+	for (int i=0; i < 20; i++) CHECK(memcmp(out + i * 10, data[i], 10) == 0);
+	CHECK(dest_is(s, IPAddress(10, 0, 0, 10)));
+	// a datagram without a destination ends the batch
+	packets[5].remotePort = 0;
+	CHECK(udp.sendPackets(packets, 20) == 5);
+	CHECK(model.drain(s, out, sizeof(out)) == 50);
+	udp.stop();
+}
+
+// A scan only reads the sockets the socket interrupt register names,
+// and keeps their events for the caller
+static uint8_t scan(uint8_t *status)
+{
+	W5100.beginTransaction();
+	uint8_t signalled = W5100.scanSockets(status);
+	W5100.endTransaction();
+	return signalled;
+}
+
+static void test_scan_cache()
+{
+	EthernetUDP udp;
+	uint8_t status[MAX_SOCK_NUM];
+
+	CHECK(udp.begin(11));
+	uint8_t s = udp.getSocketNumber();
+	scan(status);
+	uint32_t frames = model.frames;
+	CHECK(scan(status) == 0);
+	CHECK(status[s] == SnSR::UDP);
+	CHECK(model.frames - frames == 1); // SIR only
+	host_udp(s, IPAddress(10, 0, 0, 9), 1234, "x", 1);
+	CHECK(scan(status) == (1 << s));
+	CHECK(status[s] == SnSR::UDP);
+	CHECK(W5100.getSnEvents(s) & SnIR::RECV);
+	CHECK(udp.parsePacket() == 1);
+	udp.stop();
+}
+
+// Buffers are only resized when they and every buffer above them,
+// which moves along, belong to closed sockets
+static void test_buffer_resize()
+{
+	EthernetUDP udp, above;
+
+	CHECK(udp.begin(10));
+	CHECK(above.begin(12));
+	uint8_t s = udp.getSocketNumber();
+	CHECK(above.getSocketNumber() > s);
+	CHECK(!Ethernet.setSocketBufferSize(s, 1, 1));
+	udp.stop();
+	CHECK(!Ethernet.setSocketBufferSize(s, 1, 1));
+	above.stop();
+	CHECK(!Ethernet.setSocketBufferSize(s, 0, 2));
+	CHECK(!Ethernet.setSocketBufferSize(s, 2, 0));
+	CHECK(!Ethernet.setSocketBufferSize(s, 3, 2));
+	CHECK(Ethernet.setSocketBufferSize(s, 1, 1));
+	CHECK(W5100.TXSIZE(s) == 1024 && W5100.RXSIZE(s) == 1024);
+	// buffers above an open socket move without touching its own
+	CHECK(udp.begin(10));
+	s = udp.getSocketNumber();
+	CHECK(Ethernet.setSocketBufferSize(s + 1, 1, 1));
+	CHECK(Ethernet.setSocketBufferSize(s + 1, 2, 2));
+	udp.stop();
+	CHECK(Ethernet.setSocketBufferSize(s, 2, 2));
+}
+
+// Byte i of a test stream.  Doesn't repeat every 64K like RX pointers.
+static uint8_t stream_byte(uint32_t i)
+{
+	return i % 251;
+}
+
+// Keep the chip's RX buffer for socket s full of the test stream
+static void stream_feed(uint8_t s, uint32_t *sent)
+{
+	uint8_t buf[256];
+
+	for (uint16_t i=0; i < sizeof(buf); i++) buf[i] = stream_byte(*sent + i);
+	*sent += model.inject(s, buf, sizeof(buf));
+}
+
+// After a small read is served from the read-ahead copy, large reads
+// which bypass the copy move RX_RD on.  64K later the 16 bit RX_RD is
+// back inside the old copy, which must not be used again.
+static void test_read_ahead_wrap()
+{
+	EthernetClient client;
+	uint32_t sent = 0, got = 0;
+	uint8_t buf[64];
+	bool same = true;
+
+	CHECK(client.connect(IPAddress(10, 0, 0, 5), 80));
+	uint8_t s = client.getSocketNumber();
+	stream_feed(s, &sent);
+	CHECK(client.read() == stream_byte(got++));
+	while (got < 65537) {
+		stream_feed(s, &sent);
+		int n = client.read(buf, sizeof(buf));
+		for (int i=0; i < n; i++) {
+			if (buf[i] != stream_byte(got + i)) same = false;
+		}
+		// stream_feed() just made data arrive
+		CHECK(n > 0);
+		if (n <= 0) break;
+		got += n;
+	}
+	CHECK(same);
+	stream_feed(s, &sent);
+	CHECK(client.read() == stream_byte(got++));
+	CHECK(client.peek() == stream_byte(got));
+	client.stop();
+}
+
+// With commands taking a while, buffer pointers are only written once
+// the socket's previous command has been carried out
+static void test_deferred_commands()
+{
+	EthernetClient client;
+	EthernetUDP udp;
+	uint8_t buf[256];
+	uint32_t sent = 0;
+
+	CHECK(client.connect(IPAddress(10, 0, 0, 5), 80));
+	uint8_t s = client.getSocketNumber();
+	client.setNoDelay(false);
+	CHECK(udp.begin(13));
+	model.latency = 6;
+	model.hazards = 0;
+	for (int i=0; i < 20; i++) {
+		// each read is large enough to hand the space back at once
+		for (int j=0; j < 4; j++) stream_feed(s, &sent);
+		for (int j=0; j < 4; j++) client.read(buf, sizeof(buf));
+		// each line is sent while the next is written
+		client.write((const uint8_t *)"line\n", 5);
+		client.write((const uint8_t *)"line\n", 5);
+		model.drain(s, buf, sizeof(buf));
+		host_udp(udp.getSocketNumber(), IPAddress(10, 0, 0, 9), 1234, "abcdefgh", 8);
+		host_udp(udp.getSocketNumber(), IPAddress(10, 0, 0, 9), 1234, "ijklmnop", 8);
+		CHECK(udp.parsePacket() == 8);
+		CHECK(udp.parsePacket() == 8);
+	}
+	CHECK(model.hazards == 0);
+	model.latency = 0;
+	udp.stop();
+	client.stop();
+}
+
+static uint16_t read_chunks(EthernetClient &client, uint16_t len)
+{
+	uint8_t buf[16];
+	uint16_t got = 0;
+
+	while (got < len) {
+		int n = client.read(buf, sizeof(buf));
+		if (n <= 0) break;
+		got += n;
+	}
+	return got;
+}
+
+// Sock_RECV hands space back every eighth of the RX buffer, and every
+// 32nd while the buffer is nearly full
+static void test_recv_batching()
+{
+	EthernetClient client;
+	uint32_t sent = 0;
+
+	CHECK(client.connect(IPAddress(10, 0, 0, 5), 80));
+	uint8_t s = client.getSocketNumber();
+	uint16_t size = W5100.RXSIZE(s);
+	while (sent < size / 2) stream_feed(s, &sent);
+	uint16_t before = Ethernet.socketRecvCommands(s);
+	CHECK(read_chunks(client, size / 2) == size / 2);
+	CHECK(Ethernet.socketRecvCommands(s) - before == 4);
+	while (sent < size / 2 + size) stream_feed(s, &sent);
+	before = Ethernet.socketRecvCommands(s);
+	CHECK(read_chunks(client, size / 4) == size / 4);
+	CHECK(Ethernet.socketRecvCommands(s) - before == 8);
+	client.stop();
+}
+
+// A socket reserved for use outside the library (as ICMP does) is
+// reported by poll() as the chip sees it, whatever its last user left
+static void test_reserved_poll()
+{
+	EthernetUDP udp;
+	EthernetSocketEvents events[MAX_SOCK_NUM];
+	uint8_t buf[4];
+
+	CHECK(udp.begin(11));
+	uint8_t s = udp.getSocketNumber();
+	host_udp(s, IPAddress(10, 0, 0, 9), 1234, "stale", 5);
+	CHECK(udp.parsePacket() == 5);
+	CHECK(udp.read(buf, 2) == 2);
+	udp.stop();
+
+	CHECK(Ethernet.socketReserve(s));
+	W5100.beginTransaction();
+	W5100.writeSnMR(s, SnMR::IPRAW);
+	W5100.execCmdSn(s, Sock_OPEN);
+	W5100.endTransaction();
+	model.inject(s, (const uint8_t *)"0123456789", 10);
+	uint8_t n = Ethernet.poll(events), i = 0;
+	while (i < n && events[i].socket != s) i++;
+	CHECK(i < n);
+	if (i < n) {
+		CHECK(events[i].readable == 10);
+		CHECK(events[i].events & EthernetReadable);
+	}
+	W5100.beginTransaction();
+	W5100.execCmdSn(s, Sock_CLOSE);
+	W5100.endTransaction();
+	Ethernet.socketRelease(s);
+}
+
+// readPackets() passes over datagrams the peer filter doesn't match
+static void test_read_packets_filter()
+{
+	EthernetUDP udp;
+	uint8_t b0[8], b1[8];
+	EthernetUDPPacket packets[2];
+
+	packets[0].data = b0;
+	packets[0].size = sizeof(b0);
+	packets[1].data = b1;
+	packets[1].size = sizeof(b1);
+	CHECK(udp.begin(12));
+	uint8_t s = udp.getSocketNumber();
+	udp.setPeerFilter(IPAddress(10, 0, 0, 9), 53);
+	host_udp(s, IPAddress(10, 0, 0, 8), 53, "other", 5);
+	host_udp(s, IPAddress(10, 0, 0, 9), 53, "first", 5);
+	host_udp(s, IPAddress(10, 0, 0, 9), 54, "port", 4);
+	host_udp(s, IPAddress(10, 0, 0, 9), 53, "second", 6);
+	CHECK(udp.readPackets(packets, 2) == 2);
+	CHECK(packets[0].length == 5 && memcmp(b0, "first", 5) == 0);
+	CHECK(packets[1].length == 6 && memcmp(b1, "second", 6) == 0);
+	CHECK(packets[1].remoteIP == IPAddress(10, 0, 0, 9));
+	CHECK(udp.readPackets(packets, 2) == 0);
+	udp.clearPeerFilter();
+	CHECK(udp.parsePacket() == 0);
+	udp.stop();
+}
+
+// Queue an IGMP membership query for group (0.0.0.0 for all) on the
+// MACRAW socket 0, as the chip stores it behind a 2 byte length
+static void igmp_query(IPAddress group)
+{
+	uint8_t f[2 + 60];
+	uint8_t *ip = f + 2 + 14, *igmp = ip + 24;
+
+	memset(f, 0, sizeof(f));
+	f[1] = sizeof(f);
+	f[2] = 0x01;
+	f[4] = 0x5E;
+	f[7] = 0x01;
+	f[14] = 0x08;
+	ip[0] = 0x46;
+	ip[9] = 2;
+	ip[12] = 10;
+	ip[15] = 1;
+	ip[16] = 224;
+	ip[19] = 1;
+	igmp[0] = 0x11;
+	igmp[1] = 100;
+	for (uint8_t i=0; i < 4; i++) igmp[4 + i] = group[i];
+	model.inject(0, f, sizeof(f));
+}
+
+// In group mode IGMP queries get reports, so the groups stay joined
+static void test_group_queries()
+{
+	static const IPAddress groups[2] = {
+		IPAddress(239, 255, 0, 1), IPAddress(239, 255, 0, 2)
+	};
+	EthernetUDP udp;
+	uint8_t out[200];
+	EthernetUDPPacket packet;
+
+	CHECK(udp.beginMulticast(groups, 2, 6454));
+	CHECK(model.drain(0, out, sizeof(out)) == 120); // the joins
+
+	igmp_query(IPAddress(0, 0, 0, 0));
+	CHECK(udp.parsePacket() == 0);
+	CHECK(model.drain(0, out, sizeof(out)) == 120);
+	CHECK(out[38] == 0x16 && groups[0] == out + 42);
+	CHECK(out[60 + 38] == 0x16 && groups[1] == out + 60 + 42);
+
+	igmp_query(groups[1]);
+	igmp_query(IPAddress(239, 9, 9, 9));
+	CHECK(udp.parsePacket() == 0);
+	CHECK(model.drain(0, out, sizeof(out)) == 60);
+	CHECK(groups[1] == out + 42);
+
+	packet.data = out;
+	packet.size = sizeof(out);
+	igmp_query(groups[0]);
+	CHECK(udp.readPackets(&packet, 1) == 0);
+	udp.stop();
+}
+
+// A remote host connects to a listening socket
+static uint8_t chip_status(uint8_t s)
+{
+	W5100.beginTransaction();
+	uint8_t stat = W5100.readSnSR(s);
+	W5100.endTransaction();
+	return stat;
+}
+
+static uint8_t connect_listener(uint16_t port)
+{
+	for (uint8_t s=0; s < MAX_SOCK_NUM; s++) {
+		W5100.beginTransaction();
+		uint8_t stat = W5100.readSnSR(s);
+		uint16_t sport = W5100.readSnPORT(s);
+		W5100.endTransaction();
+		if (stat == SnSR::LISTEN && sport == port && model.establish(s)) return s;
+	}
+	return MAX_SOCK_NUM;
+}
+
+// accept() hands out the oldest connection, also when the arrival
+// stamps wrap around between them
+static void test_accept_order()
+{
+	EthernetServer server(80, 3);
+	uint8_t queue[3], queued = 0;
+	bool inorder = true;
+
+	server.begin();
+	for (uint16_t i=0; i < 600; i++) {
+		uint8_t s = connect_listener(80);
+		CHECK(s < MAX_SOCK_NUM);
+		queue[queued++] = s;
+		server.available(); // seen, but no data to hand out yet
+		if (queued < 3) continue;
+		EthernetClient client = server.accept();
+		if (client.getSocketNumber() != queue[0]) inorder = false;
+		client.stop();
+		queue[0] = queue[1];
+		queue[1] = queue[2];
+		queued--;
+	}
+	CHECK(inorder);
+}
+
+// An empty write on a coalescing connection does nothing at all
+static void test_empty_write()
+{
+	EthernetClient client;
+	uint8_t out[8];
+
+	CHECK(client.connect(IPAddress(10, 0, 0, 5), 80));
+	uint8_t s = client.getSocketNumber();
+	client.setNoDelay(false);
+	uint32_t frames = model.frames;
+	CHECK(client.write((const uint8_t *)"", 0) == 0);
+	CHECK(model.frames == frames);
+	CHECK(client.write((const uint8_t *)"ab\n", 3) == 3);
+	CHECK(model.drain(s, out, sizeof(out)) == 3);
+	client.stop();
+}
+
+// A coalesced write to a reset connection takes nothing
+static void test_write_after_reset()
+{
+	EthernetClient client;
+	uint8_t out[8];
+
+	CHECK(client.connect(IPAddress(10, 0, 0, 5), 80));
+	uint8_t s = client.getSocketNumber();
+	client.setNoDelay(false);
+	CHECK(client.write((const uint8_t *)"ab", 2) == 2);
+	CHECK(client.write((const uint8_t *)"\n", 1) == 1);
+	CHECK(model.drain(s, out, sizeof(out)) == 3);
+	CHECK(model.abort(s));
+	CHECK(client.write((const uint8_t *)"cd", 2) == 0);
+	CHECK(model.drain(s, out, sizeof(out)) == 0);
+	client.stop();
+}
+
+// A client that closed gracefully gives its socket back, so poll()
+// skips it
+static void test_stop_releases()
+{
+	EthernetClient client;
+	EthernetSocketEvents events[MAX_SOCK_NUM];
+
+	CHECK(client.connect(IPAddress(10, 0, 0, 5), 80));
+	uint8_t s = client.getSocketNumber();
+	client.stop();
+	CHECK(chip_status(s) == SnSR::CLOSED);
+	uint8_t n = Ethernet.poll(events);
+	for (uint8_t i=0; i < n; i++) CHECK(events[i].socket != s);
+}
+
+// Pipelined writes return with their Sock_SEND still running, and the
+// data still goes out whole and in order
+static void test_pipelined_send()
+{
+	EthernetClient client;
+	uint8_t data[300], out[400];
+
+	CHECK(client.connect(IPAddress(10, 0, 0, 5), 80));
+	uint8_t s = client.getSocketNumber();
+	for (int i=0; i < 300; i++) data[i] = i;
+	model.latency = 3;
+	CHECK(client.write(data, 100) == 100);
+	W5100.beginTransaction();
+	bool done = W5100.cmdSnDone(s);
+	W5100.endTransaction();
+#ifdef ETHERNET_PIPELINED_SEND
+	CHECK(!done);
+#else
+	CHECK(done);
+#endif
+	CHECK(client.write(data + 100, 100) == 100);
+	CHECK(client.write(data + 200, 100) == 100);
+	W5100.beginTransaction();
+	W5100.cmdSnWait(s);
+	W5100.endTransaction();
+	model.latency = 0;
+	CHECK(model.drain(s, out, sizeof(out)) == 300);
+	CHECK(memcmp(out, data, 300) == 0);
+	client.stop();
+}
+
+// Sent data holds TX buffer space until the model's wire takes it
+static void test_tx_backlog()
+{
+	EthernetClient client;
+	uint8_t out[128];
+
+	CHECK(client.connect(IPAddress(10, 0, 0, 5), 80));
+	uint8_t s = client.getSocketNumber();
+	int room = client.availableForWrite();
+	CHECK(room == W5100.TXSIZE(s));
+	memset(out, 'x', 100);
+	CHECK(client.write(out, 100) == 100);
+	CHECK(client.availableForWrite() == room - 100);
+	CHECK(model.drain(s, out, sizeof(out)) == 100);
+	CHECK(client.availableForWrite() == room);
+	client.stop();
+}
+
+// Connections opened side by side without blocking: one is answered,
+// the other times out
+static void test_connect_async()
+{
+	EthernetClient a, b;
+
+	model.silent = true;
+	unsigned long start = host_ms;
+	CHECK(a.connectAsync(IPAddress(10, 0, 0, 5), 80));
+	CHECK(b.connectAsync(IPAddress(10, 0, 0, 6), 80));
+	CHECK(host_ms - start < 10);
+	CHECK(a.connectStatus() == EthernetClient::CONNECT_IN_PROGRESS);
+	CHECK(b.connectStatus() == EthernetClient::CONNECT_IN_PROGRESS);
+	CHECK(model.establish(a.getSocketNumber()));
+	CHECK(a.connectStatus() == EthernetClient::CONNECT_SUCCESS);
+	CHECK(a.connected());
+	CHECK(b.connectStatus() == EthernetClient::CONNECT_IN_PROGRESS);
+	uint8_t s = b.getSocketNumber();
+	delay(2000);
+	CHECK(b.connectStatus() == EthernetClient::CONNECT_TIMED_OUT);
+	CHECK(chip_status(s) == SnSR::CLOSED);
+	CHECK(b.connectStatus() == EthernetClient::CONNECT_FAILED);
+	model.silent = false;
+	a.stop();
+}
+
+// The pool hands an idle connection back without a new handshake,
+// keeps it alive while idle, and drops it once the server closes it
+static void test_client_pool()
+{
+	EthernetClientPool pool(1000);
+	IPAddress ip(10, 0, 0, 5);
+	uint8_t out[8];
+
+	EthernetClient c = pool.get(ip, 80);
+	CHECK(c.connected());
+	uint8_t s = c.getSocketNumber();
+	CHECK(c.write((const uint8_t *)"one\n", 4) == 4);
+	CHECK(model.drain(s, out, sizeof(out)) == 4);
+	pool.release(c);
+	CHECK(!c);
+
+	// held, so nobody else gets the socket meanwhile
+	EthernetClient other;
+	CHECK(other.connect(IPAddress(10, 0, 0, 6), 80));
+	CHECK(other.getSocketNumber() != s);
+	other.stop();
+
+	c = pool.get(ip, 80);
+	CHECK(c.getSocketNumber() == s);
+	CHECK(c.connected());
+	pool.release(c);
+
+	uint32_t keepalives = model.keepalives;
+	pool.maintain();
+	CHECK(model.keepalives == keepalives);
+	delay(1000);
+	pool.maintain();
+	CHECK(model.keepalives == keepalives + 1);
+
+	CHECK(model.hangup(s));
+	pool.maintain();
+	CHECK(chip_status(s) == SnSR::CLOSED);
+	c = pool.get(ip, 80);
+	CHECK(c.connected());
+	c.stop();
+	pool.clear();
+}
+
+// A request parsed inside the RX buffer, across its end: delimiters
+// found, tokens compared, and nothing consumed until skip()
+static void test_tcp_in_place()
+{
+	EthernetClient client;
+	static uint8_t fill[2000];
+	const char *req = "GET /index.html HTTP/1.1\r\nHost: x\r\n"
+		"X-Padding: 0123456789012345678901234567890123456789\r\n\r\nbody";
+	uint8_t buf[16];
+
+	CHECK(client.connect(IPAddress(10, 0, 0, 5), 80));
+	uint8_t s = client.getSocketNumber();
+	CHECK(model.inject(s, fill, sizeof(fill)) == sizeof(fill));
+	CHECK(client.skip(sizeof(fill)) == (int)sizeof(fill));
+	int len = strlen(req);
+	CHECK(model.inject(s, (const uint8_t *)req, len) == len);
+
+	int eol = client.indexOf("\r\n");
+	CHECK(eol == 24);
+	CHECK(client.matches(0, "get ", true));
+	CHECK(!client.matches(0, "POST"));
+	CHECK(client.indexOf(" ", 4) == 15);
+	CHECK(client.peek(4, buf, 11) == 11);
+	CHECK(memcmp(buf, "/index.html", 11) == 0);
+	CHECK(client.available() == len);
+	CHECK(client.indexOf("\r\n\r\n") == len - 8);
+	CHECK(client.indexOf("\r\n\r\n\r\n") == -1);
+	CHECK(client.skip(eol + 2) == eol + 2);
+	CHECK(client.matches(0, "Host:"));
+	CHECK(client.skip(len - 4 - (eol + 2)) == len - 4 - (eol + 2));
+	CHECK(client.read(buf, sizeof(buf)) == 4);
+	CHECK(memcmp(buf, "body", 4) == 0);
+	client.stop();
+}
+
+// poll() takes the CON interrupt, and accept() must still see the client
+static void test_poll_then_accept()
+{
+	EthernetServer server(81);
+	EthernetSocketEvents events[MAX_SOCK_NUM];
+
+	server.begin();
+	server.available(); // the socket table now holds LISTEN
+	uint8_t s = connect_listener(81);
+	CHECK(s < MAX_SOCK_NUM);
+	Ethernet.poll(events);
+	EthernetClient client = server.accept();
+	CHECK(client.getSocketNumber() == s);
+	client.stop();
+}
+
+// poll() takes the DISCON interrupt, and the server must still notice
+// the remote close and finish the connection
+static void test_poll_then_remote_close()
+{
+	EthernetServer server(82);
+	EthernetSocketEvents events[MAX_SOCK_NUM];
+
+	server.begin();
+	uint8_t s = connect_listener(82);
+	CHECK(s < MAX_SOCK_NUM);
+	server.available(); // seen, no data
+	Ethernet.poll(events);
+	CHECK(model.hangup(s));
+	Ethernet.poll(events);
+	server.available();
+	CHECK(chip_status(s) == SnSR::CLOSED);
+}
+
+int main()
+{
+	host_begin();
+	test_udp_echo();
+	test_udp_in_place();
+	test_status_snapshot();
+	test_scan_cache();
+	test_register_shadow();
+	test_dest_burst();
+	test_gather_write();
+	test_udp_batch_send();
+	test_buffer_resize();
+	test_read_ahead_wrap();
+	test_recv_batching();
+	test_deferred_commands();
+	test_reserved_poll();
+	test_read_packets_filter();
+	test_group_queries();
+	test_accept_order();
+	test_empty_write();
+	test_write_after_reset();
+	test_stop_releases();
+	test_tx_backlog();
+	test_pipelined_send();
+	test_connect_async();
+	test_client_pool();
+	test_tcp_in_place();
+	test_poll_then_accept();
+	test_poll_then_remote_close();
+	if (failures) {
+		printf("%d check(s) failed\n", failures);
+		return 1;
+	}
+	printf("all tests passed\n");
+	return 0;
+}
@@ -43,6 +43,8 @@ int DhcpClass::request_DHCP_lease()
 		// Couldn't get a socket
 		return 0;
 	}
+	// Replies may come from any server, but only from the server port
+	_dhcpUdpSocket.setPeerFilter(IPAddress(0,0,0,0), DHCP_SERVER_PORT);
 
 	presend_DHCP();
 
@@ -250,20 +252,20 @@ uint8_t DhcpClass::parseDHCPResponse(unsigned long responseTimeout, uint32_t& tr
 	RIP_MSG_FIXED fixedMsg;
 	_dhcpUdpSocket.read((uint8_t*)&fixedMsg, sizeof(RIP_MSG_FIXED));
 
-	if (fixedMsg.op == DHCP_BOOTREPLY && _dhcpUdpSocket.remotePort() == DHCP_SERVER_PORT) {
+	if (fixedMsg.op == DHCP_BOOTREPLY) {
 		transactionId = ntohl(fixedMsg.xid);
 		if (memcmp(fixedMsg.chaddr, _dhcpMacAddr, 6) != 0 ||
 		  (transactionId < _dhcpInitialTransactionId) ||
 		  (transactionId > _dhcpTransactionId)) {
 			// Need to read the rest of the packet here regardless
-			_dhcpUdpSocket.flush(); // FIXME
+			_dhcpUdpSocket.skip(_dhcpUdpSocket.available());
 			return 0;
 		}
 
 		memcpy(_dhcpLocalIp, fixedMsg.yiaddr, 4);
 
 		// Skip to the option part
-		_dhcpUdpSocket.read((uint8_t *)NULL, 240 - (int)sizeof(RIP_MSG_FIXED));
+		_dhcpUdpSocket.skip(240 - (int)sizeof(RIP_MSG_FIXED));
 
 		while (_dhcpUdpSocket.available() > 0) {
 		        uint8_t dhcpOption = _dhcpUdpSocket.read();
@@ -289,13 +291,13 @@ uint8_t DhcpClass::parseDHCPResponse(unsigned long responseTimeout, uint32_t& tr
 			case routersOnSubnet :
 				opt_len = _dhcpUdpSocket.read();
 				_dhcpUdpSocket.read(_dhcpGatewayIp, 4);
-				_dhcpUdpSocket.read((uint8_t *)NULL, opt_len - 4);
+				_dhcpUdpSocket.skip(opt_len - 4);
 				break;
 
 			case dns :
 				opt_len = _dhcpUdpSocket.read();
 				_dhcpUdpSocket.read(_dhcpDnsServerIp, 4);
-				_dhcpUdpSocket.read((uint8_t *)NULL, opt_len - 4);
+				_dhcpUdpSocket.skip(opt_len - 4);
 				break;
 
 			case dhcpServerIdentifier :
@@ -305,7 +307,7 @@ uint8_t DhcpClass::parseDHCPResponse(unsigned long responseTimeout, uint32_t& tr
 					_dhcpUdpSocket.read(_dhcpDhcpServerIp, sizeof(_dhcpDhcpServerIp));
 				} else {
 					// Skip over the rest of this option
-					_dhcpUdpSocket.read((uint8_t *)NULL, opt_len);
+					_dhcpUdpSocket.skip(opt_len);
 				}
 				break;
 
@@ -331,14 +333,14 @@ uint8_t DhcpClass::parseDHCPResponse(unsigned long responseTimeout, uint32_t& tr
 			default :
 				opt_len = _dhcpUdpSocket.read();
 				// Skip over the rest of this option
-				_dhcpUdpSocket.read((uint8_t *)NULL, opt_len);
+				_dhcpUdpSocket.skip(opt_len);
 				break;
 			}
 		}
 	}
 
 	// Need to skip to end of the packet regardless here
-	_dhcpUdpSocket.flush(); // FIXME
+	_dhcpUdpSocket.skip(_dhcpUdpSocket.available());
 
 	return type;
 }
@@ -102,6 +102,8 @@ int DNSClient::getHostByName(const char* aHostname, IPAddress& aResult, uint16_t
 	
 	// Find a socket to use
 	if (iUdp.begin(1024+(millis() & 0xF)) == 1) {
+		// Anything not from the server is dropped before we see it
+		iUdp.setPeerFilter(iDNSServer, DNS_PORT);
 		// Try up to three times
 		int retries = 0;
 		// while ((retries < 3) && (ret <= 0)) {
@@ -231,12 +233,6 @@ uint16_t DNSClient::ProcessResponse(uint16_t aTimeout, IPAddress& aAddress)
 		uint16_t word[DNS_HEADER_SIZE/2];
 	} header;
 
-	// Check that it's a response from the right server and the right port
-	if ( (iDNSServer != iUdp.remoteIP()) || (iUdp.remotePort() != DNS_PORT) ) {
-		// It's not from who we expected
-		return INVALID_SERVER;
-	}
-
 	// Read through the rest of the response
 	if (iUdp.available() < DNS_HEADER_SIZE) {
 		return TRUNCATED;
@@ -248,14 +244,14 @@ uint16_t DNSClient::ProcessResponse(uint16_t aTimeout, IPAddress& aAddress)
 	if ((iRequestId != (header.word[0])) ||
 	  ((header_flags & QUERY_RESPONSE_MASK) != (uint16_t)RESPONSE_FLAG) ) {
 		// Mark the entire packet as read
-		iUdp.flush(); // FIXME
+		iUdp.skip(iUdp.available());
 		return INVALID_RESPONSE;
 	}
 	// Check for any errors in the response (or in our request)
 	// although we don't do anything to get round these
 	if ( (header_flags & TRUNCATION_FLAG) || (header_flags & RESP_MASK) ) {
 		// Mark the entire packet as read
-		iUdp.flush(); // FIXME
+		iUdp.skip(iUdp.available());
 		return -5; //INVALID_RESPONSE;
 	}
 
@@ -263,7 +259,7 @@ uint16_t DNSClient::ProcessResponse(uint16_t aTimeout, IPAddress& aAddress)
 	uint16_t answerCount = htons(header.word[3]);
 	if (answerCount == 0) {
 		// Mark the entire packet as read
-		iUdp.flush(); // FIXME
+		iUdp.skip(iUdp.available());
 		return -6; //INVALID_RESPONSE;
 	}
 
@@ -276,12 +272,12 @@ uint16_t DNSClient::ProcessResponse(uint16_t aTimeout, IPAddress& aAddress)
 			if (len > 0) {
 				// Don't need to actually read the data out for the string, just
 				// advance ptr to beyond it
-				iUdp.read((uint8_t *)NULL, (size_t)len);
+				iUdp.skip(len);
 			}
 		} while (len != 0);
 
 		// Now jump over the type and class
-		iUdp.read((uint8_t *)NULL, 4);
+		iUdp.skip(4);
 	}
 
 	// Now we're up to the bit we're interested in, the answer
@@ -300,7 +296,7 @@ uint16_t DNSClient::ProcessResponse(uint16_t aTimeout, IPAddress& aAddress)
 					// And it's got a length
 					// Don't need to actually read the data out for the string,
 					// just advance ptr to beyond it
-					iUdp.read((uint8_t *)NULL, len);
+					iUdp.skip(len);
 				}
 			} else {
 				// This is a pointer to a somewhere else in the message for the
@@ -310,7 +306,7 @@ uint16_t DNSClient::ProcessResponse(uint16_t aTimeout, IPAddress& aAddress)
 				// a pointer.  Either way, when we get here we're at the end of
 				// the name
 				// Skip over the pointer
-				iUdp.read((uint8_t *)NULL, 1); // we don't care about the byte
+				iUdp.skip(1); // we don't care about the byte
 				// And set len so that we drop out of the name loop
 				len = 0;
 			}
@@ -323,7 +319,7 @@ uint16_t DNSClient::ProcessResponse(uint16_t aTimeout, IPAddress& aAddress)
 		iUdp.read((uint8_t*)&answerClass, sizeof(answerClass));
 
 		// Ignore the Time-To-Live as we don't do any caching
-		iUdp.read((uint8_t *)NULL, TTL_SIZE); // don't care about the returned bytes
+		iUdp.skip(TTL_SIZE); // don't care about the returned bytes
 
 		// And read out the length of this answer
 		// Don't need header_flags anymore, so we can reuse it here
@@ -333,7 +329,7 @@ uint16_t DNSClient::ProcessResponse(uint16_t aTimeout, IPAddress& aAddress)
 			if (htons(header_flags) != 4) {
 				// It's a weird size
 				// Mark the entire packet as read
-				iUdp.flush(); // FIXME
+				iUdp.skip(iUdp.available());
 				return -9;//INVALID_RESPONSE;
 			}
 			// FIXME: seeems to lock up here on ESP8266, but why??
@@ -341,12 +337,12 @@ uint16_t DNSClient::ProcessResponse(uint16_t aTimeout, IPAddress& aAddress)
 			return SUCCESS;
 		} else {
 			// This isn't an answer type we're after, move onto the next one
-			iUdp.read((uint8_t *)NULL, htons(header_flags));
+			iUdp.skip(htons(header_flags));
 		}
 	}
 
 	// Mark the entire packet as read
-	iUdp.flush(); // FIXME
+	iUdp.skip(iUdp.available());
 
 	// If we get here then we haven't found an answer
 	return -10; //INVALID_RESPONSE;
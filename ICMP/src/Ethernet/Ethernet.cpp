@@ -34,21 +34,21 @@ int EthernetClass::begin(uint8_t *mac, unsigned long timeout, unsigned long resp
 
 	// Initialise the basic info
 	if (W5100.init() == 0) return 0;
-	SPI.beginTransaction(SPI_ETHERNET_SETTINGS);
+	W5100.beginTransaction();
 	W5100.setMACAddress(mac);
 	W5100.setIPAddress(IPAddress(0,0,0,0).raw_address());
-	SPI.endTransaction();
+	W5100.endTransaction();
 
 	// Now try to get our config info from a DHCP server
 	int ret = _dhcp->beginWithDHCP(mac, timeout, responseTimeout);
 	if (ret == 1) {
 		// We've successfully found a DHCP server and got our configuration
 		// info, so set things accordingly
-		SPI.beginTransaction(SPI_ETHERNET_SETTINGS);
+		W5100.beginTransaction();
 		W5100.setIPAddress(_dhcp->getLocalIp().raw_address());
 		W5100.setGatewayIp(_dhcp->getGatewayIp().raw_address());
 		W5100.setSubnetMask(_dhcp->getSubnetMask().raw_address());
-		SPI.endTransaction();
+		W5100.endTransaction();
 		_dnsServerAddress = _dhcp->getDnsServerIp();
           	//added by sadman 18/04/2020
 		_dhcpServerAddress = _dhcp->getDhcpServerIp();
@@ -84,7 +84,7 @@ void EthernetClass::begin(uint8_t *mac, IPAddress ip, IPAddress dns, IPAddress g
 void EthernetClass::begin(uint8_t *mac, IPAddress ip, IPAddress dns, IPAddress gateway, IPAddress subnet)
 {
 	if (W5100.init() == 0) return;
-	SPI.beginTransaction(SPI_ETHERNET_SETTINGS);
+	W5100.beginTransaction();
 	W5100.setMACAddress(mac);
 #if ARDUINO > 106 || TEENSYDUINO > 121
 	W5100.setIPAddress(ip._address.bytes);
@@ -95,17 +95,31 @@ void EthernetClass::begin(uint8_t *mac, IPAddress ip, IPAddress dns, IPAddress g
 	W5100.setGatewayIp(gateway._address);
 	W5100.setSubnetMask(subnet._address);
 #endif
-	SPI.endTransaction();
+	W5100.endTransaction();
 	_dnsServerAddress = dns;
 }
 
-void EthernetClass::init(uint8_t sspin)
+void EthernetClass::init(uint8_t sspin, bool fastStart)
 {
 	W5100.setSS(sspin);
+	W5100.setFastStart(fastStart);
 	//added by sadman 18/04/2020
         W5100.init();
 }
 
+uint16_t EthernetClass::initTime()
+{
+	return W5100.getInitTime();
+}
+
+bool EthernetClass::setSocketBufferSize(uint8_t s, uint8_t txkb, uint8_t rxkb)
+{
+	W5100.beginTransaction();
+	bool ret = W5100.setSnBufSize(s, txkb, rxkb);
+	W5100.endTransaction();
+	return ret;
+}
+
 EthernetLinkStatus EthernetClass::linkStatus()
 {
 	switch (W5100.getLinkStatus()) {
@@ -139,11 +153,11 @@ int EthernetClass::maintain()
 		case DHCP_CHECK_RENEW_OK:
 		case DHCP_CHECK_REBIND_OK:
 			//we might have got a new IP.
-			SPI.beginTransaction(SPI_ETHERNET_SETTINGS);
+			W5100.beginTransaction();
 			W5100.setIPAddress(_dhcp->getLocalIp().raw_address());
 			W5100.setGatewayIp(_dhcp->getGatewayIp().raw_address());
 			W5100.setSubnetMask(_dhcp->getSubnetMask().raw_address());
-			SPI.endTransaction();
+			W5100.endTransaction();
 			_dnsServerAddress = _dhcp->getDnsServerIp();
 			break;
 		default:
@@ -157,82 +171,82 @@ int EthernetClass::maintain()
 
 void EthernetClass::MACAddress(uint8_t *mac_address)
 {
-	SPI.beginTransaction(SPI_ETHERNET_SETTINGS);
+	W5100.beginTransaction();
 	W5100.getMACAddress(mac_address);
-	SPI.endTransaction();
+	W5100.endTransaction();
 }
 
 IPAddress EthernetClass::localIP()
 {
 	IPAddress ret;
-	SPI.beginTransaction(SPI_ETHERNET_SETTINGS);
+	W5100.beginTransaction();
 	W5100.getIPAddress(ret.raw_address());
-	SPI.endTransaction();
+	W5100.endTransaction();
 	return ret;
 }
 
 IPAddress EthernetClass::subnetMask()
 {
 	IPAddress ret;
-	SPI.beginTransaction(SPI_ETHERNET_SETTINGS);
+	W5100.beginTransaction();
 	W5100.getSubnetMask(ret.raw_address());
-	SPI.endTransaction();
+	W5100.endTransaction();
 	return ret;
 }
 
 IPAddress EthernetClass::gatewayIP()
 {
 	IPAddress ret;
-	SPI.beginTransaction(SPI_ETHERNET_SETTINGS);
+	W5100.beginTransaction();
 	W5100.getGatewayIp(ret.raw_address());
-	SPI.endTransaction();
+	W5100.endTransaction();
 	return ret;
 }
 
 void EthernetClass::setMACAddress(const uint8_t *mac_address)
 {
-	SPI.beginTransaction(SPI_ETHERNET_SETTINGS);
+	W5100.beginTransaction();
 	W5100.setMACAddress(mac_address);
-	SPI.endTransaction();
+	W5100.endTransaction();
 }
 
 void EthernetClass::setLocalIP(const IPAddress local_ip)
 {
-	SPI.beginTransaction(SPI_ETHERNET_SETTINGS);
+	W5100.beginTransaction();
 	IPAddress ip = local_ip;
 	W5100.setIPAddress(ip.raw_address());
-	SPI.endTransaction();
+	W5100.endTransaction();
 }
 
 void EthernetClass::setSubnetMask(const IPAddress subnet)
 {
-	SPI.beginTransaction(SPI_ETHERNET_SETTINGS);
+	W5100.beginTransaction();
 	IPAddress ip = subnet;
 	W5100.setSubnetMask(ip.raw_address());
-	SPI.endTransaction();
+	W5100.endTransaction();
 }
 
 void EthernetClass::setGatewayIP(const IPAddress gateway)
 {
-	SPI.beginTransaction(SPI_ETHERNET_SETTINGS);
+	W5100.beginTransaction();
 	IPAddress ip = gateway;
 	W5100.setGatewayIp(ip.raw_address());
-	SPI.endTransaction();
+	W5100.endTransaction();
 }
 
 void EthernetClass::setRetransmissionTimeout(uint16_t milliseconds)
 {
 	if (milliseconds > 6553) milliseconds = 6553;
-	SPI.beginTransaction(SPI_ETHERNET_SETTINGS);
+	W5100.beginTransaction();
 	W5100.setRetransmissionTime(milliseconds * 10);
-	SPI.endTransaction();
+	W5100.endTransaction();
 }
 
 void EthernetClass::setRetransmissionCount(uint8_t num)
 {
-	SPI.beginTransaction(SPI_ETHERNET_SETTINGS);
+	W5100.beginTransaction();
 	W5100.setRetransmissionCount(num);
-	SPI.endTransaction();
+	W5100.endTransaction();
 }
 
 
@@ -45,8 +45,37 @@
 // can really help with UDP protocols like Artnet.  In theory larger
 // buffers should allow faster TCP over high-latency links, but this
 // does not always seem to work in practice (maybe Wiznet bugs?)
+// Ethernet.setSocketBufferSize() can also change them at runtime.
 //#define ETHERNET_LARGE_BUFFERS
 
+// Reading one byte at a time, as EthernetUDP::read() and
+// EthernetClient::read() do when parsing DHCP options or text
+// protocols, normally costs a SPI transfer per byte.  Uncomment this to
+// keep a small RAM copy of the next received bytes for each socket, so
+// small reads are served from RAM.  Uses this many bytes per socket.
+//#define ETHERNET_READ_AHEAD 32
+
+// By default each EthernetClient write() waits until the chip reports
+// the data sent (SEND_OK).  Uncomment this to return as soon as the
+// data is in the chip's buffer, so the next write() fills the buffer
+// while the previous data is still going out.  The wait then happens
+// only before the next send, when the buffer is full, or in flush().
+// A connection lost during the last write is reported by the next one.
+//#define ETHERNET_PIPELINED_SEND
+
+// EthernetClient::setNoDelay(false) lets small writes collect in the
+// chip's transmit buffer, so print() of a line becomes one TCP segment
+// instead of one per call.  They are sent when ETHERNET_COALESCE_SIZE
+// bytes are waiting, when a write ends with a newline, by flush(), or
+// after ETHERNET_COALESCE_MS (noticed by the client's write, available
+// and connected, or by Ethernet.poll()).
+#ifndef ETHERNET_COALESCE_SIZE
+#define ETHERNET_COALESCE_SIZE 1460
+#endif
+#ifndef ETHERNET_COALESCE_MS
+#define ETHERNET_COALESCE_MS 5
+#endif
+
 
 #include <Arduino.h>
 #include "Client.h"
@@ -66,6 +95,35 @@ enum EthernetHardwareStatus {
 	EthernetW5500
 };
 
+// Flags in EthernetSocketEvents.events, filled by Ethernet.poll()
+enum EthernetPollEvent {
+	EthernetReadable     = 0x01, // received data waiting
+	EthernetWritable     = 0x02, // space in the transmit buffer
+	EthernetConnected    = 0x04, // TCP connection made (since last poll)
+	EthernetDisconnected = 0x08, // remote closed TCP (since last poll)
+	EthernetTimeout      = 0x10  // ARP or TCP timeout
+};
+
+struct EthernetSocketEvents {
+	uint8_t  socket;   // as from getSocketNumber()
+	uint8_t  status;   // SnSR
+	uint8_t  events;   // EthernetPollEvent flags
+	uint16_t readable; // bytes received
+	uint16_t writable; // free transmit buffer space
+};
+
+// One datagram for EthernetUDP::readPackets().  The caller sets data and
+// size, the rest is filled in.  Bytes beyond size are dropped.  For
+// EthernetUDP::sendPackets() the caller sets data, length, remoteIP and
+// remotePort, and size is not used.
+struct EthernetUDPPacket {
+	uint8_t  *data;      // buffer for the payload
+	uint16_t size;       // size of that buffer
+	uint16_t length;     // payload length as received
+	IPAddress remoteIP;
+	uint16_t remotePort;
+};
+
 class EthernetUDP;
 class EthernetClient;
 class EthernetServer;
@@ -91,7 +149,27 @@ public:
 	static void begin(uint8_t *mac, IPAddress ip, IPAddress dns);
 	static void begin(uint8_t *mac, IPAddress ip, IPAddress dns, IPAddress gateway);
 	static void begin(uint8_t *mac, IPAddress ip, IPAddress dns, IPAddress gateway, IPAddress subnet);
-	static void init(uint8_t sspin = 10);
+	// fastStart skips the fixed wait for the shield's reset pulse when
+	// the chip is known to be running already (e.g. waking from sleep)
+	static void init(uint8_t sspin = 10, bool fastStart = false);
+	// Milliseconds spent bringing up the Ethernet chip
+	static uint16_t initTime();
+	// Give one socket different TX and RX buffer sizes, in KB.  Must be
+	// a power of 2 from 1 up, and all sockets must fit in the chip.  The
+	// socket must be closed, and every higher numbered socket too,
+	// because their buffers move.  Returns false otherwise.
+	static bool setSocketBufferSize(uint8_t s, uint8_t txkb, uint8_t rxkb);
+	// Sock_RECV commands issued on a socket since it was opened.  Each
+	// one returns consumed buffer space to the chip.
+	static uint16_t socketRecvCommands(uint8_t s);
+	// Keep a socket for code using it directly through the W5100 driver,
+	// like ICMP, so no client, server or UDP gets the same socket.
+	static bool socketReserve(uint8_t s);
+	static void socketRelease(uint8_t s);
+	// Check every open socket in one sweep, for event loops serving
+	// several clients, servers, UDP or ICMP sockets.  events must have
+	// room for MAX_SOCK_NUM entries.  Returns the number filled in.
+	static uint8_t poll(EthernetSocketEvents *events);
 
 	static void MACAddress(uint8_t *mac_address);
 	static IPAddress localIP();
@@ -113,11 +191,20 @@ public:
 	friend class EthernetClient;
 	friend class EthernetServer;
 	friend class EthernetUDP;
+	friend class EthernetClientPool;
 private:
 	// Opens a socket(TCP or UDP or IP_RAW mode)
 	static uint8_t socketBegin(uint8_t protocol, uint16_t port);
 	static uint8_t socketBeginMulticast(uint8_t protocol, IPAddress ip,uint16_t port);
+	// Opens socket 0 in MACRAW mode, for several multicast groups
+	static uint8_t socketBeginMACRAW();
+	// IGMPv2 join (report) and leave, sent from a MACRAW socket
+	static const uint8_t IGMP_REPORT = 0x16;
+	static const uint8_t IGMP_LEAVE = 0x17;
+	static bool socketSendIGMP(uint8_t s, uint8_t type, IPAddress group);
+	static uint8_t socketAllocate(uint8_t maxindex);
 	static uint8_t socketStatus(uint8_t s);
+	static uint8_t socketScan(uint8_t *status);
 	// Close socket
 	static void socketClose(uint8_t s);
 	// Establish TCP connection (Active connection)
@@ -128,11 +215,25 @@ private:
 	static uint8_t socketListen(uint8_t s);
 	// Send data (TCP)
 	static uint16_t socketSend(uint8_t s, const uint8_t * buf, uint16_t len);
+	// socketSend(), or with coalescing on, add to the waiting data
+	static uint16_t socketWrite(uint8_t s, const uint8_t * buf, uint16_t len);
+	static bool socketSendPending(uint8_t s, bool timed);
+	static void socketSetCoalescing(uint8_t s, bool on);
+	// Keep an open socket from being reused while it sits idle
+	static void socketHold(uint8_t s, bool hold);
+	static void socketSendKeepAlive(uint8_t s);
 	static uint16_t socketSendAvailable(uint8_t s);
 	// Receive data (TCP)
 	static int socketRecv(uint8_t s, uint8_t * buf, int16_t len);
 	static uint16_t socketRecvAvailable(uint8_t s);
 	static uint8_t socketPeek(uint8_t s);
+	static uint16_t socketPeek(uint8_t s, uint16_t offset, uint8_t *buf, uint16_t len);
+	// Get the 8 byte header of the next UDP datagram from ip and port
+	// (0.0.0.0 or 0 for any), passing over those from anyone else
+	static bool socketRecvUDPHeader(uint8_t s, uint8_t *head, const uint8_t *ip, uint16_t port);
+	// Take up to count whole UDP datagrams from ip and port (0.0.0.0 or 0
+	// for any).  Datagrams from anyone else are passed over.
+	static uint8_t socketRecvPackets(uint8_t s, EthernetUDPPacket *packets, uint8_t count, const uint8_t *ip, uint16_t port);
 	// sets up a UDP datagram, the data for which will be provided by one
 	// or more calls to bufferData and then finally sent with sendUDP.
 	// return true if the datagram was successfully set up, or false if there was an error
@@ -145,6 +246,10 @@ private:
 	// calls to bufferData.
 	// return true if the datagram was successfully sent, or false if there was an error
 	static bool socketSendUDP(uint8_t s);
+	// Send several complete datagrams, staging as many as fit in the
+	// transmit buffer before the first Sock_SEND.
+	// return the number of datagrams sent
+	static uint8_t socketSendPackets(uint8_t s, const EthernetUDPPacket *packets, uint8_t count);
 	// Initialize the "random" source port number
 	static void socketPortRand(uint16_t n);
 };
@@ -160,15 +265,32 @@ private:
 	IPAddress _remoteIP; // remote IP address for the incoming packet whilst it's being processed
 	uint16_t _remotePort; // remote port for the incoming packet whilst it's being processed
 	uint16_t _offset; // offset into the packet being sent
+	IPAddress _peerIP; // only receive packets from this IP address, unless 0.0.0.0
+	uint16_t _peerPort; // only receive packets from this port, unless 0
+	const IPAddress *_groups; // multicast groups, when the socket is MACRAW
+	uint8_t _ngroups;
+	IPAddress _destIP; // group the incoming packet was sent to
+	uint16_t _pad; // bytes after the incoming packet in its Ethernet frame
+	int parseGroupPacket();
 
 protected:
 	uint8_t sockindex;
 	uint16_t _remaining; // remaining bytes of incoming packet yet to be processed
+	uint16_t _length; // size of incoming packet
 
 public:
-	EthernetUDP() : sockindex(MAX_SOCK_NUM) {}  // Constructor
+	EthernetUDP() : _peerPort(0), _groups(NULL), sockindex(MAX_SOCK_NUM) {}  // Constructor
+	uint8_t getSocketNumber() const { return sockindex; }
 	virtual uint8_t begin(uint16_t);      // initialize, start listening on specified port. Returns 1 if successful, 0 if there are no sockets available to use
 	virtual uint8_t beginMulticast(IPAddress, uint16_t);  // initialize, start listening on specified port. Returns 1 if successful, 0 if there are no sockets available to use
+	// Listen to count multicast groups on one socket.  This takes socket
+	// 0 in MACRAW mode, so call it before other sockets are opened.  The
+	// groups array must stay valid until stop().  Receive only: use
+	// another EthernetUDP to send, and parsePacket(), not readPackets().
+	// parsePacket() also answers IGMP queries, so call it regularly to
+	// stay in the groups.  Returns 1 if successful, 0 if socket 0 is in
+	// use.
+	uint8_t beginMulticast(const IPAddress *groups, uint8_t count, uint16_t port);
 	virtual void stop();  // Finish with the UDP socket
 
 	// Sending UDP packets
@@ -206,11 +328,44 @@ public:
 	virtual int peek();
 	virtual void flush(); // Finish reading the current packet
 
+	// The current packet can also be used in place, inside the Ethernet
+	// chip, without copying all of it to RAM.  Copy len bytes starting
+	// offset bytes ahead, without moving on.  Returns the number copied.
+	int peek(size_t offset, uint8_t *buffer, size_t len);
+	// Move on by len bytes without copying them.  Returns the number skipped.
+	int skip(size_t len);
+	// Size of the current packet, and how far into it we've read
+	int packetLength() { return _length; }
+	int position() { return _length - _remaining; }
+
+	// Only receive packets from ip and port (either may be 0 for any).
+	// parsePacket() passes over packets from anyone else inside the
+	// Ethernet chip, without reading their data.  begin() clears it.
+	void setPeerFilter(IPAddress ip, uint16_t port) { _peerIP = ip; _peerPort = port; }
+	void clearPeerFilter() { setPeerFilter(IPAddress(0,0,0,0), 0); }
+
+	// Read up to count whole packets at once, with one SPI transaction
+	// and a single Sock_RECV for all of them.  For fast incoming streams
+	// (syslog, many sensors) which parsePacket() can't keep up with.
+	// The peer filter applies as with parsePacket().  Returns the number
+	// of packets read.
+	int readPackets(EthernetUDPPacket *packets, uint8_t count);
+	// Send count whole packets, each to its own remoteIP and remotePort.
+	// The payloads are copied into the transmit buffer up front and the
+	// Sock_SEND commands follow back to back, so a burst of small packets
+	// costs far less than beginPacket/write/endPacket for each.  Don't
+	// use it between beginPacket() and endPacket().
+	// Returns the number of packets sent.
+	int sendPackets(const EthernetUDPPacket *packets, uint8_t count);
+
 	// Return the IP address of the host who sent the current incoming packet
 	virtual IPAddress remoteIP() { return _remoteIP; };
 	// Return the port of the host who sent the current incoming packet
 	virtual uint16_t remotePort() { return _remotePort; };
 	virtual uint16_t localPort() { return _port; }
+	// Return the multicast group the current incoming packet was sent to,
+	// with beginMulticast() for several groups
+	IPAddress destinationIP() { return _destIP; }
 };
 
 
@@ -218,12 +373,24 @@ public:
 
 class EthernetClient : public Client {
 public:
-	EthernetClient() : sockindex(MAX_SOCK_NUM), _timeout(1000) { }
-	EthernetClient(uint8_t s) : sockindex(s), _timeout(1000) { }
+	EthernetClient() : sockindex(MAX_SOCK_NUM), _timeout(1000), _connecting(false) { }
+	EthernetClient(uint8_t s) : sockindex(s), _timeout(1000), _connecting(false) { }
 
 	uint8_t status();
 	virtual int connect(IPAddress ip, uint16_t port);
 	virtual int connect(const char *host, uint16_t port);
+	// Start connecting without waiting for it, so several connections
+	// can be opened at once while the sketch goes on with other work.
+	// Returns 1 if the connection was started, 0 if there was a problem
+	// with the address or no socket is free.
+	int connectAsync(IPAddress ip, uint16_t port);
+	// Check on connectAsync().  Returns one of the CONNECT_ codes, and
+	// gives up the socket if the connection failed or timed out.
+	int connectStatus();
+	static const int CONNECT_IN_PROGRESS = 0;
+	static const int CONNECT_SUCCESS     = 1;
+	static const int CONNECT_TIMED_OUT   = -1; // no answer within the connection timeout
+	static const int CONNECT_FAILED      = -2; // refused, or never started
 	virtual int availableForWrite(void);
 	virtual size_t write(uint8_t);
 	virtual size_t write(const uint8_t *buf, size_t size);
@@ -244,22 +411,47 @@ public:
 	virtual IPAddress remoteIP();
 	virtual uint16_t remotePort();
 	virtual void setConnectionTimeout(uint16_t timeout) { _timeout = timeout; }
+	// false collects small writes into fewer, larger segments (see
+	// ETHERNET_COALESCE_SIZE).  Stays with the connection, not the object.
+	void setNoDelay(bool nodelay);
+
+	// Received data can also be parsed in place, inside the Ethernet
+	// chip, with offsets counted from the next byte read() would return.
+	// Nothing is consumed until skip(), so a request line or header can
+	// be located and checked before deciding how much to take.
+	// Copy len bytes starting offset bytes ahead.  Returns the number copied.
+	int peek(size_t offset, uint8_t *buf, size_t len);
+	// Offset of the first delim (up to 32 chars, e.g. "\r\n") at or after
+	// from, or -1 if it hasn't been received
+	int indexOf(const char *delim, size_t from = 0);
+	// Whether token has been received at offset
+	bool matches(size_t offset, const char *token, bool ignoreCase = false);
+	// Move on by len bytes without copying them.  Returns the number skipped.
+	int skip(size_t len);
 
 	friend class EthernetServer;
+	friend class EthernetClientPool;
 
 	using Print::write;
 
 private:
 	uint8_t sockindex; // MAX_SOCK_NUM means client not in use
 	uint16_t _timeout;
+	bool _connecting; // connectAsync() started, connectStatus() not yet done
+	uint32_t _connectStart;
 };
 
 
 class EthernetServer : public Server {
 private:
 	uint16_t _port;
+	uint8_t _backlog;
+	void listen(uint8_t listening);
+	uint8_t arrived(uint8_t s, uint8_t stat);
 public:
-	EthernetServer(uint16_t port) : _port(port) { }
+	// backlog is how many sockets are kept listening, so that many
+	// clients connecting at the same moment are all accepted
+	EthernetServer(uint16_t port, uint8_t backlog = 1) : _port(port), _backlog(backlog) { }
 	EthernetClient available();
 	EthernetClient accept();
 	virtual void begin();
@@ -271,6 +463,36 @@ public:
 
 	// TODO: make private when socket allocation moves to EthernetClass
 	static uint16_t server_port[MAX_SOCK_NUM];
+	// When each connection was first seen, to hand them out in order
+	static uint8_t server_arrival[MAX_SOCK_NUM];
+};
+
+
+// Keeps outgoing connections open between uses, so periodic reports to
+// the same server skip the socket setup, handshake and teardown.
+class EthernetClientPool {
+public:
+	EthernetClientPool(uint32_t keepAliveInterval = 30000) :
+		_idle(0), _interval(keepAliveInterval) { }
+	// A connection to ip and port, idle in the pool if there is one,
+	// otherwise newly connected.  Test it like any EthernetClient.
+	EthernetClient get(IPAddress ip, uint16_t port);
+	// Put a connection back for the next get().  Its data is sent first.
+	// Connections which have closed or have unread data are stopped.
+	void release(EthernetClient &client);
+	// Send keep-alives on idle connections every keepAliveInterval
+	// milliseconds, and drop those found dead.  Call this from loop().
+	void maintain();
+	void setKeepAliveInterval(uint32_t ms) { _interval = ms; }
+	// Close every idle connection
+	void clear();
+private:
+	void drop(uint8_t s);
+	uint8_t _idle; // one bit per socket
+	uint32_t _interval;
+	IPAddress _ip[MAX_SOCK_NUM];
+	uint16_t _port[MAX_SOCK_NUM];
+	uint32_t _lastUsed[MAX_SOCK_NUM];
 };
 
 
@@ -0,0 +1,124 @@
+/*
+ * This file is free software; you can redistribute it and/or modify
+ * it under the terms of either the GNU General Public License version 2
+ * or the GNU Lesser General Public License version 2.1, both as
+ * published by the Free Software Foundation.
+ */
+
+// EthernetBus is the transport W5100Class uses to talk to the Wiznet
+// chip when ETHERNET_CUSTOM_BUS is defined in w5100.h.  By default the
+// library drives the Arduino SPI port directly, with no indirection.
+// With ETHERNET_CUSTOM_BUS another transport (DMA, a different SPI port
+// or settings, or the in-memory chip model for host builds) can be
+// given with W5100.setBus() before Ethernet.begin().
+
+#ifndef	ETHERNET_BUS_H_INCLUDED
+#define	ETHERNET_BUS_H_INCLUDED
+
+#include <Arduino.h>
+
+class EthernetBus {
+public:
+	virtual void begin() { }
+	// Claim and release the bus for a group of frames, which the library
+	// always does before touching the chip
+	virtual void beginTransaction() { }
+	virtual void endTransaction() { }
+	// Chip select active, starting a new frame
+	virtual void select() = 0;
+	// Shift len bytes out from txbuf (zeros if NULL) while storing the
+	// received bytes to rxbuf (discarded if NULL).  txbuf and rxbuf may
+	// be the same buffer.
+	virtual void transfer(const uint8_t *txbuf, uint8_t *rxbuf, uint16_t len) = 0;
+	// Chip select inactive, ending the frame
+	virtual void deselect() = 0;
+	// Optional asynchronous transfer, for example by DMA.  The buffers
+	// must stay untouched until transferDone() returns true.  By default
+	// the transfer is simply done right away.
+	virtual void transferAsync(const uint8_t *txbuf, uint8_t *rxbuf, uint16_t len) {
+		transfer(txbuf, rxbuf, len);
+	}
+	virtual bool transferDone() { return true; }
+};
+
+// The Arduino SPI port with SPI_ETHERNET_SETTINGS, and the chip select
+// pin set by W5100.setSS()
+class EthernetSPIBus : public EthernetBus {
+public:
+	virtual void begin();
+	virtual void beginTransaction();
+	virtual void endTransaction();
+	virtual void select();
+	virtual void transfer(const uint8_t *txbuf, uint8_t *rxbuf, uint16_t len);
+	virtual void deselect();
+};
+
+#ifdef ETHERNET_BUS_MODEL
+// A W5500 modelled in RAM, for building and benchmarking the library on
+// a host without hardware.  Register and buffer accesses behave like
+// the real chip's variable length data mode, and socket commands
+// complete at once unless latency is set.  Nothing goes on a wire:
+// inject() queues received data and drain() takes the data the library
+// sent.
+class EthernetModelBus : public EthernetBus {
+public:
+	EthernetModelBus();
+	virtual void select();
+	virtual void transfer(const uint8_t *txbuf, uint8_t *rxbuf, uint16_t len);
+	virtual void deselect();
+
+	// Receive len bytes on socket s as the chip would store them.  For
+	// UDP and IPRAW the caller includes the chip's packet header.
+	uint16_t inject(uint8_t s, const uint8_t *buf, uint16_t len);
+	// Take up to len bytes sent on socket s
+	uint16_t drain(uint8_t s, uint8_t *buf, uint16_t len);
+	// A remote host (10.0.0.77 port 40000) connects to socket s, if it
+	// is listening.  The chip fills in Sn_DIPR and Sn_DPORT.  A socket
+	// connecting while silent is set gets its answer instead.
+	bool establish(uint8_t s);
+	// The remote host closes its end of the connection on socket s
+	bool hangup(uint8_t s);
+	// The remote host resets the connection on socket s
+	bool abort(uint8_t s);
+
+	// Bus statistics, for comparing transport strategies
+	uint32_t frames;
+	uint32_t bytes;
+	// Sock_SEND_KEEP commands carried out
+	uint32_t keepalives;
+	// Frames a socket command stays in Sn_CR before it is carried out,
+	// and how often a buffer pointer or new command was written to a
+	// socket meanwhile, which the real chip would get wrong
+	uint8_t latency;
+	uint32_t hazards;
+	// While set, Sock_CONNECT gets no answer and stays in SYNSENT
+	bool silent;
+
+private:
+	void reset();
+	uint8_t access(uint8_t block, uint16_t addr, bool write, uint8_t data);
+	void command(uint8_t s, uint8_t cmd);
+	uint16_t txsize(uint8_t s) { return sreg[s][0x1F] << 10; }
+	uint16_t rxsize(uint8_t s) { return sreg[s][0x1E] << 10; }
+	uint16_t get16(uint8_t s, uint8_t reg) {
+		return (sreg[s][reg] << 8) | sreg[s][reg + 1];
+	}
+	void put16(uint8_t s, uint8_t reg, uint16_t val) {
+		sreg[s][reg] = val >> 8;
+		sreg[s][reg + 1] = val & 0xFF;
+	}
+
+	uint8_t common[0x40];
+	uint8_t sreg[8][0x30];
+	uint8_t txbuf[8][16384];
+	uint8_t rxbuf[8][16384];
+	uint16_t txsent[8]; // next byte for drain()
+	uint16_t rxread[8]; // Sn_RX_RD as of the last RECV command
+	uint8_t cmdwait[8]; // frames until the command in Sn_CR is done
+	uint8_t hdr[3];
+	uint8_t hdrlen;
+	uint16_t offset;
+};
+#endif
+
+#endif
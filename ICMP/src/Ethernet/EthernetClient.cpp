@@ -41,6 +41,17 @@ int EthernetClient::connect(const char * host, uint16_t port)
 
 int EthernetClient::connect(IPAddress ip, uint16_t port)
 {
+	if (!connectAsync(ip, port)) return 0;
+	while (1) {
+		int ret = connectStatus();
+		if (ret != CONNECT_IN_PROGRESS) return ret == CONNECT_SUCCESS;
+		delay(1);
+	}
+}
+
+int EthernetClient::connectAsync(IPAddress ip, uint16_t port)
+{
+	_connecting = false;
 	if (sockindex < MAX_SOCK_NUM) {
 		if (Ethernet.socketStatus(sockindex) != SnSR::CLOSED) {
 			Ethernet.socketDisconnect(sockindex); // TODO: should we call stop()?
@@ -55,18 +66,30 @@ int EthernetClient::connect(IPAddress ip, uint16_t port)
 	sockindex = Ethernet.socketBegin(SnMR::TCP, 0);
 	if (sockindex >= MAX_SOCK_NUM) return 0;
 	Ethernet.socketConnect(sockindex, rawIPAddress(ip), port);
-	uint32_t start = millis();
-	while (1) {
-		uint8_t stat = Ethernet.socketStatus(sockindex);
-		if (stat == SnSR::ESTABLISHED) return 1;
-		if (stat == SnSR::CLOSE_WAIT) return 1;
-		if (stat == SnSR::CLOSED) return 0;
-		if (millis() - start > _timeout) break;
-		delay(1);
+	_connectStart = millis();
+	_connecting = true;
+	return 1;
+}
+
+int EthernetClient::connectStatus()
+{
+	if (!_connecting) {
+		return (sockindex < MAX_SOCK_NUM) ? CONNECT_SUCCESS : CONNECT_FAILED;
+	}
+	uint8_t stat = Ethernet.socketStatus(sockindex);
+	if (stat == SnSR::ESTABLISHED || stat == SnSR::CLOSE_WAIT) {
+		_connecting = false;
+		return CONNECT_SUCCESS;
 	}
+	int ret = CONNECT_FAILED;
+	if (stat != SnSR::CLOSED) {
+		if (millis() - _connectStart <= _timeout) return CONNECT_IN_PROGRESS;
+		ret = CONNECT_TIMED_OUT;
+	}
+	_connecting = false;
 	Ethernet.socketClose(sockindex);
 	sockindex = MAX_SOCK_NUM;
-	return 0;
+	return ret;
 }
 
 int EthernetClient::availableForWrite(void)
@@ -83,7 +106,7 @@ size_t EthernetClient::write(uint8_t b)
 size_t EthernetClient::write(const uint8_t *buf, size_t size)
 {
 	if (sockindex >= MAX_SOCK_NUM) return 0;
-	if (Ethernet.socketSend(sockindex, buf, size)) return size;
+	if (Ethernet.socketWrite(sockindex, buf, size)) return size;
 	setWriteError();
 	return 0;
 }
@@ -91,6 +114,7 @@ size_t EthernetClient::write(const uint8_t *buf, size_t size)
 int EthernetClient::available()
 {
 	if (sockindex >= MAX_SOCK_NUM) return 0;
+	Ethernet.socketSendPending(sockindex, true);
 	return Ethernet.socketRecvAvailable(sockindex);
 	// TODO: do the Wiznet chips automatically retransmit TCP ACK
 	// packets if they are lost by the network?  Someday this should
@@ -113,6 +137,63 @@ int EthernetClient::peek()
 	return Ethernet.socketPeek(sockindex);
 }
 
+int EthernetClient::peek(size_t offset, uint8_t *buf, size_t len)
+{
+	if (sockindex >= MAX_SOCK_NUM || offset > 0xFFFF) return 0;
+	if (len > 0xFFFF) len = 0xFFFF;
+	return Ethernet.socketPeek(sockindex, offset, buf, len);
+}
+
+// Search in 32 byte pieces, each one SPI transaction.  The pieces
+// overlap by the delimiter's length less one, so it's found even when
+// split between two.
+int EthernetClient::indexOf(const char *delim, size_t from)
+{
+	uint8_t buf[32];
+	size_t dlen = strlen(delim);
+	if (sockindex >= MAX_SOCK_NUM || dlen == 0 || dlen > sizeof(buf)) return -1;
+	while (1) {
+		int n = peek(from, buf, sizeof(buf));
+		if (n < (int)dlen) return -1;
+		for (int i=0; i <= n - (int)dlen; i++) {
+			if (buf[i] == (uint8_t)delim[0] && memcmp(buf + i, delim, dlen) == 0) {
+				return from + i;
+			}
+		}
+		from += n - dlen + 1;
+	}
+}
+
+bool EthernetClient::matches(size_t offset, const char *token, bool ignoreCase)
+{
+	uint8_t buf[32];
+	size_t len = strlen(token);
+	while (len > 0) {
+		int n = (len < sizeof(buf)) ? len : sizeof(buf);
+		if (peek(offset, buf, n) != n) return false;
+		for (int i=0; i < n; i++) {
+			uint8_t a = buf[i], b = token[i];
+			if (ignoreCase) {
+				if (a >= 'A' && a <= 'Z') a += 'a' - 'A';
+				if (b >= 'A' && b <= 'Z') b += 'a' - 'A';
+			}
+			if (a != b) return false;
+		}
+		offset += n;
+		token += n;
+		len -= n;
+	}
+	return true;
+}
+
+int EthernetClient::skip(size_t len)
+{
+	if (sockindex >= MAX_SOCK_NUM) return 0;
+	if (len > 0x7FFF) len = 0x7FFF;
+	int got = Ethernet.socketRecv(sockindex, NULL, len);
+	return (got > 0) ? got : 0;
+}
+
 int EthernetClient::read()
 {
 	uint8_t b;
@@ -122,16 +203,24 @@ int EthernetClient::read()
 
 void EthernetClient::flush()
 {
+	if (sockindex < MAX_SOCK_NUM) Ethernet.socketSendPending(sockindex, false);
 	while (sockindex < MAX_SOCK_NUM) {
 		uint8_t stat = Ethernet.socketStatus(sockindex);
 		if (stat != SnSR::ESTABLISHED && stat != SnSR::CLOSE_WAIT) return;
-		if (Ethernet.socketSendAvailable(sockindex) >= W5100.SSIZE) return;
+		if (Ethernet.socketSendAvailable(sockindex) >= W5100.TXSIZE(sockindex)) return;
 	}
 }
 
+void EthernetClient::setNoDelay(bool nodelay)
+{
+	if (sockindex < MAX_SOCK_NUM) Ethernet.socketSetCoalescing(sockindex, !nodelay);
+}
+
 void EthernetClient::stop()
 {
+	_connecting = false;
 	if (sockindex >= MAX_SOCK_NUM) return;
+	Ethernet.socketSendPending(sockindex, false);
 
 	// attempt to close the connection gracefully (send a FIN to other side)
 	Ethernet.socketDisconnect(sockindex);
@@ -140,6 +229,7 @@ void EthernetClient::stop()
 	// wait up to a second for the connection to close
 	do {
 		if (Ethernet.socketStatus(sockindex) == SnSR::CLOSED) {
+			Ethernet.socketRelease(sockindex);
 			sockindex = MAX_SOCK_NUM;
 			return; // exit the loop
 		}
@@ -154,6 +244,7 @@ void EthernetClient::stop()
 uint8_t EthernetClient::connected()
 {
 	if (sockindex >= MAX_SOCK_NUM) return 0;
+	Ethernet.socketSendPending(sockindex, true);
 
 	uint8_t s = Ethernet.socketStatus(sockindex);
 	return !(s == SnSR::LISTEN || s == SnSR::CLOSED || s == SnSR::FIN_WAIT ||
@@ -182,9 +273,9 @@ uint16_t EthernetClient::localPort()
 {
 	if (sockindex >= MAX_SOCK_NUM) return 0;
 	uint16_t port;
-	SPI.beginTransaction(SPI_ETHERNET_SETTINGS);
+	W5100.beginTransaction();
 	port = W5100.readSnPORT(sockindex);
-	SPI.endTransaction();
+	W5100.endTransaction();
 	return port;
 }
 
@@ -194,9 +285,9 @@ IPAddress EthernetClient::remoteIP()
 {
 	if (sockindex >= MAX_SOCK_NUM) return IPAddress((uint32_t)0);
 	uint8_t remoteIParray[4];
-	SPI.beginTransaction(SPI_ETHERNET_SETTINGS);
+	W5100.beginTransaction();
 	W5100.readSnDIPR(sockindex, remoteIParray);
-	SPI.endTransaction();
+	W5100.endTransaction();
 	return IPAddress(remoteIParray);
 }
 
@@ -206,9 +297,9 @@ uint16_t EthernetClient::remotePort()
 {
 	if (sockindex >= MAX_SOCK_NUM) return 0;
 	uint16_t port;
-	SPI.beginTransaction(SPI_ETHERNET_SETTINGS);
+	W5100.beginTransaction();
 	port = W5100.readSnDPORT(sockindex);
-	SPI.endTransaction();
+	W5100.endTransaction();
 	return port;
 }
 
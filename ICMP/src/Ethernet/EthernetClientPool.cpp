@@ -0,0 +1,84 @@
+/*
+ * This file is free software; you can redistribute it and/or modify
+ * it under the terms of either the GNU General Public License version 2
+ * or the GNU Lesser General Public License version 2.1, both as
+ * published by the Free Software Foundation.
+ */
+
+#include <Arduino.h>
+#include "Ethernet.h"
+#include "w5100.h"
+
+// Idle connections stay allocated to this pool and are held (reserved)
+// so socketBegin() never hands them to anyone else.  They are given
+// back to normal use by get(), or by drop() once they close.
+
+EthernetClient EthernetClientPool::get(IPAddress ip, uint16_t port)
+{
+	for (uint8_t s=0; s < MAX_SOCK_NUM; s++) {
+		if (!(_idle & (1 << s)) || _ip[s] != ip || _port[s] != port) continue;
+		if (Ethernet.socketStatus(s) == SnSR::ESTABLISHED &&
+		  Ethernet.socketRecvAvailable(s) == 0) {
+			_idle &= ~(1 << s);
+			Ethernet.socketHold(s, false);
+			return EthernetClient(s);
+		}
+		drop(s);
+	}
+	EthernetClient client;
+	client.connect(ip, port);
+	return client;
+}
+
+void EthernetClientPool::release(EthernetClient &client)
+{
+	uint8_t s = client.sockindex;
+	if (s >= MAX_SOCK_NUM) return;
+	client.flush();
+	if (Ethernet.socketStatus(s) != SnSR::ESTABLISHED || client.available()) {
+		client.stop();
+		return;
+	}
+	_ip[s] = client.remoteIP();
+	_port[s] = client.remotePort();
+	_lastUsed[s] = millis();
+	_idle |= 1 << s;
+	Ethernet.socketHold(s, true);
+	client.sockindex = MAX_SOCK_NUM; // the pool has it now
+}
+
+void EthernetClientPool::maintain()
+{
+	for (uint8_t s=0; s < MAX_SOCK_NUM; s++) {
+		if (!(_idle & (1 << s))) continue;
+		// Closed after a keep-alive went unanswered, by the other end,
+		// or data arrived which nobody will read
+		if (Ethernet.socketStatus(s) != SnSR::ESTABLISHED ||
+		  Ethernet.socketRecvAvailable(s) > 0) {
+			drop(s);
+		} else if (millis() - _lastUsed[s] >= _interval) {
+			Ethernet.socketSendKeepAlive(s);
+			_lastUsed[s] = millis();
+		}
+	}
+}
+
+void EthernetClientPool::clear()
+{
+	for (uint8_t s=0; s < MAX_SOCK_NUM; s++) {
+		if (_idle & (1 << s)) drop(s);
+	}
+}
+
+// Stop holding an idle connection.  It's closed without waiting, and
+// socketBegin() can reuse the socket once the chip has finished.
+void EthernetClientPool::drop(uint8_t s)
+{
+	_idle &= ~(1 << s);
+	Ethernet.socketHold(s, false);
+	if (Ethernet.socketStatus(s) == SnSR::CLOSED) {
+		Ethernet.socketClose(s);
+	} else {
+		Ethernet.socketDisconnect(s);
+	}
+}
@@ -0,0 +1,258 @@
+/*
+ * This file is free software; you can redistribute it and/or modify
+ * it under the terms of either the GNU General Public License version 2
+ * or the GNU Lesser General Public License version 2.1, both as
+ * published by the Free Software Foundation.
+ */
+
+#include <Arduino.h>
+#include "Ethernet.h"
+#include "w5100.h"
+
+#ifdef ETHERNET_BUS_MODEL
+
+EthernetModelBus::EthernetModelBus()
+{
+	frames = 0;
+	bytes = 0;
+	keepalives = 0;
+	latency = 0;
+	hazards = 0;
+	silent = false;
+	hdrlen = 0;
+	offset = 0;
+	reset();
+}
+
+// Registers as they are after a hardware or MR software reset
+void EthernetModelBus::reset()
+{
+	memset(common, 0, sizeof(common));
+	memset(sreg, 0, sizeof(sreg));
+	memset(txsent, 0, sizeof(txsent));
+	memset(rxread, 0, sizeof(rxread));
+	memset(cmdwait, 0, sizeof(cmdwait));
+	common[0x19] = 0x07; // RTR = 2000 (200 ms)
+	common[0x1A] = 0xD0;
+	common[0x1B] = 8;    // RCR
+	common[0x2E] = 0xBF; // PHYCFGR, 100M full duplex, link up
+	common[0x39] = 4;    // VERSIONR
+	for (uint8_t s=0; s < 8; s++) {
+		sreg[s][0x16] = 0x80; // TTL
+		sreg[s][0x1E] = 2;    // RX buffer size, KB
+		sreg[s][0x1F] = 2;    // TX buffer size, KB
+	}
+}
+
+void EthernetModelBus::select()
+{
+	frames++;
+	hdrlen = 0;
+	for (uint8_t s=0; s < 8; s++) {
+		if (cmdwait[s] && --cmdwait[s] == 0) {
+			command(s, sreg[s][0x01]);
+			sreg[s][0x01] = 0;
+		}
+	}
+}
+
+void EthernetModelBus::deselect()
+{
+}
+
+// Each frame is a 16 bit offset, a control byte with the block select,
+// read/write bit and mode, then data for consecutive offsets
+void EthernetModelBus::transfer(const uint8_t *tx, uint8_t *rx, uint16_t len)
+{
+	for (uint16_t i=0; i < len; i++) {
+		uint8_t in = tx ? tx[i] : 0;
+		uint8_t out = 0;
+		if (hdrlen < 3) {
+			hdr[hdrlen++] = in;
+			offset = (hdr[0] << 8) | hdr[1];
+		} else {
+			out = access(hdr[2] >> 3, offset++, hdr[2] & 0x04, in);
+		}
+		if (rx) rx[i] = out;
+	}
+	bytes += len;
+}
+
+uint8_t EthernetModelBus::access(uint8_t block, uint16_t addr, bool write, uint8_t data)
+{
+	if (block == 0) {
+		// common registers
+		if (addr >= sizeof(common)) return 0;
+		if (write) {
+			if (addr == 0x00 && (data & 0x80)) {
+				reset();
+				return 0;
+			}
+			common[addr] = data;
+			return 0;
+		}
+		if (addr == 0x17) {
+			// SIR, one bit for each socket with any Sn_IR bit set
+			uint8_t sir = 0;
+			for (uint8_t s=0; s < 8; s++) {
+				if (sreg[s][0x02]) sir |= 1 << s;
+			}
+			return sir;
+		}
+		return common[addr];
+	}
+	uint8_t s = (block - 1) >> 2;
+	if (s >= 8) return 0;
+	switch ((block - 1) & 3) {
+	case 0: // socket registers
+		if (addr >= sizeof(sreg[s])) return 0;
+		if (write) {
+			if (cmdwait[s] && (addr == 0x01 || (addr >= 0x24 && addr <= 0x29))) {
+				// Sn_CR, TX_WR or RX_RD written under a pending command
+				hazards++;
+			}
+			if (addr == 0x01 && latency) {
+				if (cmdwait[s]) command(s, sreg[s][0x01]);
+				sreg[s][0x01] = data;
+				cmdwait[s] = latency;
+			} else if (addr == 0x01) {
+				command(s, data);
+			} else if (addr == 0x02) {
+				sreg[s][0x02] &= ~data; // write 1 to clear
+			} else if (addr != 0x03) {
+				sreg[s][addr] = data;
+			}
+			return 0;
+		}
+		// commands complete at once, but data stays in the TX buffer
+		// until drain() takes it, as if the wire were that slow
+		if (addr == 0x20) put16(s, 0x20, txsize(s) - (uint16_t)(get16(s, 0x24) - txsent[s]));
+		if (addr == 0x26) put16(s, 0x26, get16(s, 0x2A) - rxread[s]);
+		return sreg[s][addr];
+	case 1: // TX buffer
+		if (write && txsize(s)) txbuf[s][addr & (txsize(s) - 1)] = data;
+		return 0;
+	case 2: // RX buffer
+		if (!write && rxsize(s)) return rxbuf[s][addr & (rxsize(s) - 1)];
+		return 0;
+	}
+	return 0;
+}
+
+void EthernetModelBus::command(uint8_t s, uint8_t cmd)
+{
+	uint8_t *r = sreg[s];
+
+	switch (cmd) {
+	case Sock_OPEN:
+		switch (r[0x00] & 0x0F) {
+			case SnMR::TCP & 0x0F: r[0x03] = SnSR::INIT; break;
+			case SnMR::UDP:    r[0x03] = SnSR::UDP;    break;
+			case SnMR::IPRAW:  r[0x03] = SnSR::IPRAW;  break;
+			case SnMR::MACRAW: r[0x03] = SnSR::MACRAW; break;
+			default:           r[0x03] = SnSR::CLOSED; break;
+		}
+		memset(r + 0x20, 0, 0x0C); // buffer pointers
+		txsent[s] = 0;
+		rxread[s] = 0;
+		break;
+	case Sock_LISTEN:
+		if (r[0x03] == SnSR::INIT) r[0x03] = SnSR::LISTEN;
+		break;
+	case Sock_CONNECT:
+		if (r[0x03] == SnSR::INIT && silent) {
+			r[0x03] = SnSR::SYNSENT;
+		} else if (r[0x03] == SnSR::INIT) {
+			r[0x03] = SnSR::ESTABLISHED;
+			r[0x02] |= SnIR::CON;
+		}
+		break;
+	case Sock_DISCON:
+		r[0x03] = SnSR::CLOSED;
+		r[0x02] |= SnIR::DISCON;
+		break;
+	case Sock_CLOSE:
+		r[0x03] = SnSR::CLOSED;
+		break;
+	case Sock_SEND:
+	case Sock_SEND_MAC:
+		put16(s, 0x22, get16(s, 0x24)); // TX_RD = TX_WR
+		r[0x02] |= SnIR::SEND_OK;
+		break;
+	case Sock_SEND_KEEP:
+		if (r[0x03] == SnSR::ESTABLISHED) keepalives++;
+		break;
+	case Sock_RECV:
+		rxread[s] = get16(s, 0x28);
+		if (get16(s, 0x2A) != rxread[s]) r[0x02] |= SnIR::RECV;
+		break;
+	}
+}
+
+uint16_t EthernetModelBus::inject(uint8_t s, const uint8_t *buf, uint16_t len)
+{
+	if (s >= 8 || sreg[s][0x03] == SnSR::CLOSED) return 0;
+	uint16_t size = rxsize(s);
+	uint16_t wr = get16(s, 0x2A);
+	uint16_t avail = size - (uint16_t)(wr - rxread[s]);
+	if (len > avail) len = avail;
+	for (uint16_t i=0; i < len; i++) {
+		rxbuf[s][wr++ & (size - 1)] = buf[i];
+	}
+	put16(s, 0x2A, wr);
+	if (len) sreg[s][0x02] |= SnIR::RECV;
+	return len;
+}
+
+bool EthernetModelBus::establish(uint8_t s)
+{
+	static const uint8_t remote[6] = {10, 0, 0, 77, 40000 >> 8, 40000 & 0xFF};
+
+	if (s >= 8) return false;
+	if (sreg[s][0x03] == SnSR::SYNSENT) {
+		sreg[s][0x03] = SnSR::ESTABLISHED;
+		sreg[s][0x02] |= SnIR::CON;
+		return true;
+	}
+	if (sreg[s][0x03] != SnSR::LISTEN) return false;
+	memcpy(sreg[s] + 0x0C, remote, 6); // Sn_DIPR, Sn_DPORT
+	sreg[s][0x03] = SnSR::ESTABLISHED;
+	sreg[s][0x02] |= SnIR::CON;
+	return true;
+}
+
+bool EthernetModelBus::hangup(uint8_t s)
+{
+	if (s >= 8 || sreg[s][0x03] != SnSR::ESTABLISHED) return false;
+	sreg[s][0x03] = SnSR::CLOSE_WAIT;
+	sreg[s][0x02] |= SnIR::DISCON;
+	return true;
+}
+
+bool EthernetModelBus::abort(uint8_t s)
+{
+	if (s >= 8 || sreg[s][0x03] != SnSR::ESTABLISHED) return false;
+	sreg[s][0x03] = SnSR::CLOSED;
+	sreg[s][0x02] |= SnIR::DISCON;
+	return true;
+}
+
+uint16_t EthernetModelBus::drain(uint8_t s, uint8_t *buf, uint16_t len)
+{
+	if (s >= 8) return 0;
+	uint16_t size = txsize(s);
+	uint16_t rd = get16(s, 0x22);
+	uint16_t n = rd - txsent[s];
+	if (n > size) {
+		// not drained in time, older data was overwritten
+		txsent[s] = rd - size;
+		n = size;
+	}
+	if (len > n) len = n;
+	for (uint16_t i=0; i < len; i++) {
+		buf[i] = txbuf[s][txsent[s]++ & (size - 1)];
+	}
+	return len;
+}
+
+#endif
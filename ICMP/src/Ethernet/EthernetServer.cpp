@@ -23,37 +23,83 @@
 #include "w5100.h"
 
 uint16_t EthernetServer::server_port[MAX_SOCK_NUM];
+uint8_t EthernetServer::server_arrival[MAX_SOCK_NUM];
+static uint8_t arrival_count;
 
 
 void EthernetServer::begin()
 {
-	uint8_t sockindex = Ethernet.socketBegin(SnMR::TCP, _port);
-	if (sockindex < MAX_SOCK_NUM) {
+	uint8_t listening = 0, maxindex=MAX_SOCK_NUM, status[MAX_SOCK_NUM];
+
+	if (!W5100.getChip()) return;
+#if MAX_SOCK_NUM > 4
+	if (W5100.getChip() == 51) maxindex = 4; // W5100 chip never supports more than 4 sockets
+#endif
+	Ethernet.socketScan(status);
+	for (uint8_t i=0; i < maxindex; i++) {
+		if (server_port[i] == _port && status[i] == SnSR::LISTEN) listening++;
+	}
+	listen(listening);
+}
+
+// Open more listening sockets, until there are _backlog of them
+void EthernetServer::listen(uint8_t listening)
+{
+	for (; listening < _backlog; listening++) {
+		uint8_t sockindex = Ethernet.socketBegin(SnMR::TCP, _port);
+		if (sockindex >= MAX_SOCK_NUM) return; // all sockets are in use
 		if (Ethernet.socketListen(sockindex)) {
 			server_port[sockindex] = _port;
+			server_arrival[sockindex] = 0;
 		} else {
 			Ethernet.socketDisconnect(sockindex);
+			return;
 		}
 	}
 }
 
+// How long ago (in connections to any server) a connected socket was
+// first seen.  The chip doesn't tell which connection came first, so
+// those first seen in the same scan go by socket number.  Stamps run
+// 1 to 255, 0 means not seen yet, so ages are counted modulo 255.
+uint8_t EthernetServer::arrived(uint8_t s, uint8_t stat)
+{
+	if (stat != SnSR::ESTABLISHED && stat != SnSR::CLOSE_WAIT) return 0;
+	if (server_arrival[s] == 0) {
+		if (++arrival_count == 0) arrival_count = 1;
+		server_arrival[s] = arrival_count;
+	}
+	uint8_t age = arrival_count - server_arrival[s];
+	// the count wrapped since, and skipped 0
+	if (arrival_count < server_arrival[s]) age--;
+	return age + 1;
+}
+
 EthernetClient EthernetServer::available()
 {
-	bool listening = false;
+	uint8_t listening = 0, age = 0;
 	uint8_t sockindex = MAX_SOCK_NUM;
-	uint8_t chip, maxindex=MAX_SOCK_NUM;
+	uint8_t chip, maxindex=MAX_SOCK_NUM, status[MAX_SOCK_NUM];
 
 	chip = W5100.getChip();
 	if (!chip) return EthernetClient(MAX_SOCK_NUM);
 #if MAX_SOCK_NUM > 4
 	if (chip == 51) maxindex = 4; // W5100 chip never supports more than 4 sockets
 #endif
+	Ethernet.socketScan(status);
 	for (uint8_t i=0; i < maxindex; i++) {
 		if (server_port[i] == _port) {
-			uint8_t stat = Ethernet.socketStatus(i);
-			if (stat == SnSR::ESTABLISHED || stat == SnSR::CLOSE_WAIT) {
-				if (Ethernet.socketRecvAvailable(i) > 0) {
-					sockindex = i;
+			uint8_t stat = status[i];
+			uint8_t a = arrived(i, stat);
+			if (a) {
+				// Without a RECV event the last check found no data
+				// and none arrived since, so skip reading RX_RSR
+				if ((W5100.getSnEvents(i) & SnIR::RECV) &&
+				  Ethernet.socketRecvAvailable(i) > 0) {
+					if (a > age) {
+						sockindex = i;
+						age = a;
+					}
 				} else {
 					// remote host closed connection, our end still open
 					if (stat == SnSR::CLOSE_WAIT) {
@@ -62,57 +108,65 @@ EthernetClient EthernetServer::available()
 					}
 				}
 			} else if (stat == SnSR::LISTEN) {
-				listening = true;
+				listening++;
 			} else if (stat == SnSR::CLOSED) {
 				server_port[i] = 0;
 			}
 		}
 	}
-	if (!listening) begin();
+	listen(listening);
 	return EthernetClient(sockindex);
 }
 
 EthernetClient EthernetServer::accept()
 {
-	bool listening = false;
+	uint8_t listening = 0, age = 0;
 	uint8_t sockindex = MAX_SOCK_NUM;
-	uint8_t chip, maxindex=MAX_SOCK_NUM;
+	uint8_t chip, maxindex=MAX_SOCK_NUM, status[MAX_SOCK_NUM];
 
 	chip = W5100.getChip();
 	if (!chip) return EthernetClient(MAX_SOCK_NUM);
 #if MAX_SOCK_NUM > 4
 	if (chip == 51) maxindex = 4; // W5100 chip never supports more than 4 sockets
 #endif
+	Ethernet.socketScan(status);
 	for (uint8_t i=0; i < maxindex; i++) {
 		if (server_port[i] == _port) {
-			uint8_t stat = Ethernet.socketStatus(i);
-			if (sockindex == MAX_SOCK_NUM &&
-			  (stat == SnSR::ESTABLISHED || stat == SnSR::CLOSE_WAIT)) {
+			uint8_t stat = status[i];
+			uint8_t a = arrived(i, stat);
+			if (a) {
 				// Return the connected client even if no data received.
 				// Some protocols like FTP expect the server to send the
 				// first data.
-				sockindex = i;
-				server_port[i] = 0; // only return the client once
+				if (a > age) {
+					sockindex = i;
+					age = a;
+				}
 			} else if (stat == SnSR::LISTEN) {
-				listening = true;
+				listening++;
 			} else if (stat == SnSR::CLOSED) {
 				server_port[i] = 0;
 			}
 		}
 	}
-	if (!listening) begin();
+	if (sockindex < MAX_SOCK_NUM) {
+		server_port[sockindex] = 0; // only return the client once
+	}
+	listen(listening);
 	return EthernetClient(sockindex);
 }
 
 EthernetServer::operator bool()
 {
-	uint8_t maxindex=MAX_SOCK_NUM;
+	uint8_t maxindex=MAX_SOCK_NUM, status[MAX_SOCK_NUM];
 #if MAX_SOCK_NUM > 4
 	if (W5100.getChip() == 51) maxindex = 4; // W5100 chip never supports more than 4 sockets
 #endif
+	if (!W5100.getChip()) return false;
+	Ethernet.socketScan(status);
 	for (uint8_t i=0; i < maxindex; i++) {
 		if (server_port[i] == _port) {
-			if (Ethernet.socketStatus(i) == SnSR::LISTEN) {
+			if (status[i] == SnSR::LISTEN) {
 				return true; // server is listening for incoming clients
 			}
 		}
@@ -160,7 +214,7 @@ size_t EthernetServer::write(uint8_t b)
 
 size_t EthernetServer::write(const uint8_t *buffer, size_t size)
 {
-	uint8_t chip, maxindex=MAX_SOCK_NUM;
+	uint8_t chip, maxindex=MAX_SOCK_NUM, status[MAX_SOCK_NUM];
 
 	chip = W5100.getChip();
 	if (!chip) return 0;
@@ -168,9 +222,10 @@ size_t EthernetServer::write(const uint8_t *buffer, size_t size)
 	if (chip == 51) maxindex = 4; // W5100 chip never supports more than 4 sockets
 #endif
 	available();
+	Ethernet.socketScan(status);
 	for (uint8_t i=0; i < maxindex; i++) {
 		if (server_port[i] == _port) {
-			if (Ethernet.socketStatus(i) == SnSR::ESTABLISHED) {
+			if (status[i] == SnSR::ESTABLISHED) {
 				Ethernet.socketSend(i, buffer, size);
 			}
 		}
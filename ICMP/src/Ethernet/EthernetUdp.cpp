@@ -34,11 +34,13 @@
 /* Start EthernetUDP socket, listening at local port PORT */
 uint8_t EthernetUDP::begin(uint16_t port)
 {
-	if (sockindex < MAX_SOCK_NUM) Ethernet.socketClose(sockindex);
+	stop();
 	sockindex = Ethernet.socketBegin(SnMR::UDP, port);
 	if (sockindex >= MAX_SOCK_NUM) return 0;
 	_port = port;
 	_remaining = 0;
+	_length = 0;
+	clearPeerFilter();
 	return 1;
 }
 
@@ -53,6 +55,10 @@ int EthernetUDP::available()
 void EthernetUDP::stop()
 {
 	if (sockindex < MAX_SOCK_NUM) {
+		for (uint8_t i=0; _groups && i < _ngroups; i++) {
+			Ethernet.socketSendIGMP(sockindex, EthernetClass::IGMP_LEAVE, _groups[i]);
+		}
+		_groups = NULL;
 		Ethernet.socketClose(sockindex);
 		sockindex = MAX_SOCK_NUM;
 	}
@@ -83,6 +89,12 @@ int EthernetUDP::endPacket()
 	return Ethernet.socketSendUDP(sockindex);
 }
 
+int EthernetUDP::sendPackets(const EthernetUDPPacket *packets, uint8_t count)
+{
+	if (sockindex >= MAX_SOCK_NUM) return 0;
+	return Ethernet.socketSendPackets(sockindex, packets, count);
+}
+
 size_t EthernetUDP::write(uint8_t byte)
 {
 	return write(&byte, 1);
@@ -106,18 +118,21 @@ int EthernetUDP::parsePacket()
 		read((uint8_t *)NULL, _remaining);
 	}
 
+	if (_groups) return parseGroupPacket();
+
 	if (Ethernet.socketRecvAvailable(sockindex) > 0) {
-		//HACK - hand-parse the UDP packet using TCP recv method
+		//HACK - hand-parse the UDP packet header
 		uint8_t tmpBuf[8];
 		int ret=0;
-		//read 8 header bytes and get IP and port from it
-		ret = Ethernet.socketRecv(sockindex, tmpBuf, 8);
-		if (ret > 0) {
+		//read 8 header bytes and get IP and port from it, packets
+		//from anyone but the peer filter's are passed over
+		if (Ethernet.socketRecvUDPHeader(sockindex, tmpBuf, rawIPAddress(_peerIP), _peerPort)) {
 			_remoteIP = tmpBuf;
 			_remotePort = tmpBuf[4];
 			_remotePort = (_remotePort << 8) + tmpBuf[5];
 			_remaining = tmpBuf[6];
 			_remaining = (_remaining << 8) + tmpBuf[7];
+			_length = _remaining;
 
 			// When we get here, any remaining bytes are the data
 			ret = _remaining;
@@ -128,6 +143,15 @@ int EthernetUDP::parsePacket()
 	return 0;
 }
 
+int EthernetUDP::readPackets(EthernetUDPPacket *packets, uint8_t count)
+{
+	// the MACRAW socket of several groups holds whole frames
+	if (sockindex >= MAX_SOCK_NUM || _groups) return 0;
+	// discard any remaining bytes in the last packet
+	if (_remaining) skip(_remaining);
+	return Ethernet.socketRecvPackets(sockindex, packets, count, rawIPAddress(_peerIP), _peerPort);
+}
+
 int EthernetUDP::read()
 {
 	uint8_t byte;
@@ -173,6 +197,23 @@ int EthernetUDP::peek()
 	return Ethernet.socketPeek(sockindex);
 }
 
+int EthernetUDP::peek(size_t offset, uint8_t *buffer, size_t len)
+{
+	if (sockindex >= MAX_SOCK_NUM || offset >= _remaining) return 0;
+	if (len > _remaining - offset) len = _remaining - offset;
+	return Ethernet.socketPeek(sockindex, offset, buffer, len);
+}
+
+int EthernetUDP::skip(size_t len)
+{
+	if (sockindex >= MAX_SOCK_NUM || _remaining == 0) return 0;
+	if (len > _remaining) len = _remaining;
+	int got = Ethernet.socketRecv(sockindex, NULL, len);
+	if (got <= 0) return 0;
+	_remaining -= got;
+	return got;
+}
+
 void EthernetUDP::flush()
 {
 	// TODO: we should wait for TX buffer to be emptied
@@ -181,11 +222,93 @@ void EthernetUDP::flush()
 /* Start EthernetUDP socket, listening at local port PORT */
 uint8_t EthernetUDP::beginMulticast(IPAddress ip, uint16_t port)
 {
-	if (sockindex < MAX_SOCK_NUM) Ethernet.socketClose(sockindex);
+	stop();
 	sockindex = Ethernet.socketBeginMulticast(SnMR::UDP | SnMR::MULTI, ip, port);
 	if (sockindex >= MAX_SOCK_NUM) return 0;
 	_port = port;
 	_remaining = 0;
+	_length = 0;
+	clearPeerFilter();
 	return 1;
 }
 
+uint8_t EthernetUDP::beginMulticast(const IPAddress *groups, uint8_t count, uint16_t port)
+{
+	stop();
+	sockindex = Ethernet.socketBeginMACRAW();
+	if (sockindex >= MAX_SOCK_NUM) return 0;
+	_port = port;
+	_remaining = 0;
+	_length = 0;
+	_pad = 0;
+	clearPeerFilter();
+	_groups = groups;
+	_ngroups = count;
+	for (uint8_t i=0; i < count; i++) {
+		Ethernet.socketSendIGMP(sockindex, EthernetClass::IGMP_REPORT, groups[i]);
+	}
+	return 1;
+}
+
+// parsePacket() for the MACRAW socket of beginMulticast() with several
+// groups.  UDP datagrams to our port and one of the groups are handed
+// out like any others, with destinationIP() telling which group.  IGMP
+// membership queries are answered.  Other frames are passed over after
+// looking at their headers.
+int EthernetUDP::parseGroupPacket()
+{
+	if (_pad) {
+		Ethernet.socketRecv(sockindex, NULL, _pad);
+		_pad = 0;
+	}
+	uint16_t avail;
+	while ((avail = Ethernet.socketRecvAvailable(sockindex)) > 0) {
+		// frame length, Ethernet header, IPv4 header, UDP header
+		uint8_t h[2 + 14 + 20], udp[8];
+		uint16_t len = 0;
+		if (Ethernet.socketPeek(sockindex, 0, h, sizeof(h)) == sizeof(h)) {
+			len = (h[0] << 8) | h[1];
+		}
+		if (len < sizeof(h) || len > avail) {
+			// lost track of the frames, start over with the next
+			Ethernet.socketRecv(sockindex, NULL, avail);
+			break;
+		}
+		uint16_t at = 16 + ((h[16] & 0x0F) << 2); // UDP or IGMP header
+		bool ipv4 = h[14] == 0x08 && h[15] == 0x00 && (h[16] >> 4) == 4;
+		uint8_t igmp[8];
+		if (ipv4 && h[25] == 2 && at + 8 <= len &&
+		  Ethernet.socketPeek(sockindex, at, igmp, 8) == 8 && igmp[0] == 0x11) {
+			// Membership query.  Without a report, routers and snooping
+			// switches stop forwarding the group to us.  A general query
+			// (group 0.0.0.0) asks about every group.  Reports may be
+			// delayed up to the query's max response time, but need not.
+			bool general = (igmp[4] | igmp[5] | igmp[6] | igmp[7]) == 0;
+			for (uint8_t i=0; i < _ngroups; i++) {
+				if (general || _groups[i] == igmp + 4) {
+					Ethernet.socketSendIGMP(sockindex, EthernetClass::IGMP_REPORT, _groups[i]);
+				}
+			}
+		} else if (ipv4 &&
+		  h[25] == 17 && ((h[22] & 0x3F) | h[23]) == 0 && // UDP, not fragmented
+		  at + 8 <= len && Ethernet.socketPeek(sockindex, at, udp, 8) == 8 &&
+		  ((udp[2] << 8) | udp[3]) == _port &&
+		  (_peerIP == IPAddress(0,0,0,0) || _peerIP == h + 28) &&
+		  (_peerPort == 0 || ((udp[0] << 8) | udp[1]) == _peerPort)) {
+			uint16_t ulen = (udp[4] << 8) | udp[5];
+			for (uint8_t i=0; i < _ngroups; i++) {
+				if (_groups[i] == h + 32 && ulen >= 8 && at + ulen <= len) {
+					Ethernet.socketRecv(sockindex, NULL, at + 8);
+					_remoteIP = h + 28;
+					_remotePort = (udp[0] << 8) | udp[1];
+					_destIP = h + 32;
+					_remaining = _length = ulen - 8;
+					_pad = len - at - ulen;
+					return _remaining;
+				}
+			}
+		}
+		Ethernet.socketRecv(sockindex, NULL, len);
+	}
+	return 0;
+}
@@ -21,6 +21,7 @@
 #include <Arduino.h>
 #include "Ethernet.h"
 #include "w5100.h"
+#include "socket.h"
 
 #if ARDUINO >= 156 && !defined(ARDUINO_ARCH_PIC32)
 extern void yield(void);
@@ -35,10 +36,22 @@ typedef struct {
 	uint16_t RX_RSR; // Number of bytes received
 	uint16_t RX_RD;  // Address to read
 	uint16_t TX_FSR; // Free space ready for transmit
-	uint8_t  RX_inc; // how much have we advanced RX_RD
+	uint16_t RX_inc; // how much have we advanced RX_RD
+	uint16_t RECV_count; // Sock_RECV commands issued
+	uint16_t TX_pending; // bytes written but not yet sent (coalescing)
+	uint16_t TX_since;   // millis() when the first of those was written
+#ifdef ETHERNET_READ_AHEAD
+	uint16_t RA_ptr; // RX buffer address of RA_buf[0]
+	uint8_t  RA_len; // bytes valid in RA_buf
+	uint8_t  RA_buf[ETHERNET_READ_AHEAD];
+#endif
 } socketstate_t;
 
 static socketstate_t state[MAX_SOCK_NUM];
+#ifdef ETHERNET_PIPELINED_SEND
+static uint8_t sending; // one bit per socket with Sock_SEND not yet SEND_OK
+#endif
+static uint8_t coalescing; // one bit per socket with setNoDelay(false)
 
 /*
 uint16_t getSnTX_FSR(uint8_t s);
@@ -51,6 +64,8 @@ static uint16_t getSnRX_RSR(uint8_t s);
 static void write_data(uint8_t s, uint16_t offset, const uint8_t *data, uint16_t len);
 static void read_data(uint8_t s, uint16_t src, uint8_t *dst, uint16_t len);
 */
+static bool send_written(uint8_t s);
+static bool send_due(uint8_t s);
 
 
 /*****************************************/
@@ -58,38 +73,39 @@ static void read_data(uint8_t s, uint16_t src, uint8_t *dst, uint16_t len);
 /*****************************************/
 
 
-void EthernetClass::socketPortRand(uint16_t n)
-{
-	n &= 0x3FFF;
-	local_port ^= n;
-	//Serial.printf("socketPortRand %d, srcport=%d\n", n, local_port);
-}
+// Sockets handed out by socketBegin() or reserved by socketReserve().
+// Finding a free socket needs no SPI traffic; the hardware status is
+// only read to reclaim sockets when all are allocated.
+static uint8_t allocated;
+static uint8_t reserved;
 
-uint8_t EthernetClass::socketBegin(uint8_t protocol, uint16_t port)
+// Pick a socket for socketBegin(), inside a SPI transaction
+uint8_t EthernetClass::socketAllocate(uint8_t maxindex)
 {
-	uint8_t s, status[MAX_SOCK_NUM], chip, maxindex=MAX_SOCK_NUM;
+	uint8_t s, status[MAX_SOCK_NUM];
 
-	// first check hardware compatibility
-	chip = W5100.getChip();
-	if (!chip) return MAX_SOCK_NUM; // immediate error if no hardware detected
-#if MAX_SOCK_NUM > 4
-	if (chip == 51) maxindex = 4; // W5100 chip never supports more than 4 sockets
-#endif
-	//Serial.printf("W5000socket begin, protocol=%d, port=%d\n", protocol, port);
-	SPI.beginTransaction(SPI_ETHERNET_SETTINGS);
-	// look at all the hardware sockets, use any that are closed (unused)
 	for (s=0; s < maxindex; s++) {
-		status[s] = W5100.readSnSR(s);
-		if (status[s] == SnSR::CLOSED) goto makesocket;
+		if (!(allocated & (1 << s))) goto found;
+	}
+	// All allocated, but sockets whose connection has ended (remote
+	// close, EthernetClient::stop(), etc) can be reused.  Reserved
+	// sockets belong to code outside this library and are never taken.
+	W5100.scanSockets(status);
+	for (s=0; s < maxindex; s++) {
+		if (reserved & (1 << s)) continue;
+		if (status[s] == SnSR::CLOSED) goto found;
 	}
 	//Serial.printf("W5000socket step2\n");
 	// as a last resort, forcibly close any already closing
 	for (s=0; s < maxindex; s++) {
 		uint8_t stat = status[s];
-		if (stat == SnSR::LAST_ACK) goto closemakesocket;
-		if (stat == SnSR::TIME_WAIT) goto closemakesocket;
-		if (stat == SnSR::FIN_WAIT) goto closemakesocket;
-		if (stat == SnSR::CLOSING) goto closemakesocket;
+		if (reserved & (1 << s)) continue;
+		if (stat == SnSR::LAST_ACK || stat == SnSR::TIME_WAIT ||
+		  stat == SnSR::FIN_WAIT || stat == SnSR::CLOSING) {
+			//Serial.printf("W5000socket close\n");
+			W5100.execCmdSn(s, Sock_CLOSE);
+			goto found;
+		}
 	}
 #if 0
 	Serial.printf("W5000socket step3\n");
@@ -97,15 +113,146 @@ uint8_t EthernetClass::socketBegin(uint8_t protocol, uint16_t port)
 	for (s=0; s < MAX_SOCK_NUM; s++) {
 		uint8_t stat = status[s];
 		// TODO: this also needs to check if no more data
-		if (stat == SnSR::CLOSE_WAIT) goto closemakesocket;
+		if (stat == SnSR::CLOSE_WAIT) {
+			W5100.execCmdSn(s, Sock_CLOSE);
+			goto found;
+		}
 	}
 #endif
-	SPI.endTransaction();
-	return MAX_SOCK_NUM; // all sockets are in use
-closemakesocket:
-	//Serial.printf("W5000socket close\n");
-	W5100.execCmdSn(s, Sock_CLOSE);
-makesocket:
+	return MAX_SOCK_NUM;
+found:
+	allocated |= 1 << s;
+	return s;
+}
+
+// Forget what is known about socket s, when it is opened or reserved
+static void reset_state(uint8_t s)
+{
+	state[s].RX_RSR = 0;
+	state[s].RX_RD  = 0;
+	state[s].RX_inc = 0;
+	state[s].RECV_count = 0;
+	state[s].TX_FSR = 0;
+	state[s].TX_pending = 0;
+#ifdef ETHERNET_READ_AHEAD
+	state[s].RA_len = 0;
+#endif
+	coalescing &= ~(1 << s);
+#ifdef ETHERNET_PIPELINED_SEND
+	sending &= ~(1 << s);
+#endif
+}
+
+// Take socket s for use outside of this library (e.g. ICMP through
+// IPRAW), so socketBegin() won't hand it out.  Fails if the socket is
+// reserved or still in use.
+bool EthernetClass::socketReserve(uint8_t s)
+{
+	if (s >= MAX_SOCK_NUM || (reserved & (1 << s))) return false;
+	if (allocated & (1 << s)) {
+		W5100.beginTransaction();
+		uint8_t stat = W5100.readSnSR(s);
+		W5100.endTransaction();
+		if (stat != SnSR::CLOSED) return false;
+	}
+	allocated |= 1 << s;
+	reserved |= 1 << s;
+	reset_state(s);
+	return true;
+}
+
+// Mark an open socket reserved, or not, without changing it
+void EthernetClass::socketHold(uint8_t s, bool hold)
+{
+	if (hold) {
+		reserved |= 1 << s;
+	} else {
+		reserved &= ~(1 << s);
+	}
+}
+
+// Give back a socket from socketReserve().  The caller closes it.
+void EthernetClass::socketRelease(uint8_t s)
+{
+	if (s >= MAX_SOCK_NUM) return;
+	allocated &= ~(1 << s);
+	reserved &= ~(1 << s);
+}
+
+uint8_t EthernetClass::poll(EthernetSocketEvents *events)
+{
+	uint8_t n = 0;
+
+	if (!W5100.getChip()) return 0;
+	W5100.beginTransaction();
+	for (uint8_t s=0; s < MAX_SOCK_NUM; s++) {
+		if (!(allocated & (1 << s))) continue;
+		W5100Class::snstatus_t st;
+		W5100.readSnStatus(s, &st, state[s].TX_FSR);
+		// CON and DISCON are reported once, from the chip or from
+		// an earlier scanSockets().  TIMEOUT is left for the send
+		// functions, and RECV is covered by RX_RSR.
+		uint8_t ir = st.IR | W5100.getSnEvents(s);
+		if (st.IR & (SnIR::CON | SnIR::DISCON)) {
+			W5100.writeSnIR(s, st.IR & (SnIR::CON | SnIR::DISCON));
+		}
+		W5100.clearSnEvents(s, SnIR::CON | SnIR::DISCON);
+		// with the interrupt gone, scanSockets() must not trust its table
+		W5100.invalidateSnSR(s);
+		uint16_t readable = st.RX_RSR - state[s].RX_inc;
+		// Reserved sockets are only reported.  Their state is left
+		// alone: reset by socketReserve(), or kept for a socket held
+		// open by EthernetClientPool.
+		if (!(reserved & (1 << s))) {
+			state[s].RX_RSR = readable;
+			state[s].TX_FSR = st.TX_FSR;
+			if (state[s].TX_pending && send_due(s)) send_written(s);
+		}
+
+		EthernetSocketEvents *e = events + n++;
+		e->socket = s;
+		e->status = st.SR;
+		e->readable = readable;
+		e->writable = st.TX_FSR;
+		e->events = 0;
+		if (e->readable) e->events |= EthernetReadable;
+		if (st.TX_FSR && st.SR != SnSR::CLOSED && st.SR != SnSR::LISTEN &&
+		  st.SR != SnSR::INIT && st.SR != SnSR::SYNSENT &&
+		  st.SR != SnSR::SYNRECV) {
+			e->events |= EthernetWritable;
+		}
+		if (ir & SnIR::CON) e->events |= EthernetConnected;
+		if (ir & SnIR::DISCON) e->events |= EthernetDisconnected;
+		if (ir & SnIR::TIMEOUT) e->events |= EthernetTimeout;
+	}
+	W5100.endTransaction();
+	return n;
+}
+
+void EthernetClass::socketPortRand(uint16_t n)
+{
+	n &= 0x3FFF;
+	local_port ^= n;
+	//Serial.printf("socketPortRand %d, srcport=%d\n", n, local_port);
+}
+
+uint8_t EthernetClass::socketBegin(uint8_t protocol, uint16_t port)
+{
+	uint8_t s, chip, maxindex=MAX_SOCK_NUM;
+
+	// first check hardware compatibility
+	chip = W5100.getChip();
+	if (!chip) return MAX_SOCK_NUM; // immediate error if no hardware detected
+#if MAX_SOCK_NUM > 4
+	if (chip == 51) maxindex = 4; // W5100 chip never supports more than 4 sockets
+#endif
+	//Serial.printf("W5000socket begin, protocol=%d, port=%d\n", protocol, port);
+	W5100.beginTransaction();
+	s = socketAllocate(maxindex);
+	if (s >= MAX_SOCK_NUM) {
+		W5100.endTransaction();
+		return MAX_SOCK_NUM; // all sockets are in use
+	}
 	//Serial.printf("W5000socket %d\n", s);
 	EthernetServer::server_port[s] = 0;
 	delayMicroseconds(250); // TODO: is this needed??
@@ -119,19 +266,17 @@ makesocket:
 		W5100.writeSnPORT(s, local_port);
 	}
 	W5100.execCmdSn(s, Sock_OPEN);
-	state[s].RX_RSR = 0;
+	reset_state(s);
 	state[s].RX_RD  = W5100.readSnRX_RD(s); // always zero?
-	state[s].RX_inc = 0;
-	state[s].TX_FSR = 0;
 	//Serial.printf("W5000socket prot=%d, RX_RD=%d\n", W5100.readSnMR(s), state[s].RX_RD);
-	SPI.endTransaction();
+	W5100.endTransaction();
 	return s;
 }
 
 // multicast version to set fields before open  thd
 uint8_t EthernetClass::socketBeginMulticast(uint8_t protocol, IPAddress ip, uint16_t port)
 {
-	uint8_t s, status[MAX_SOCK_NUM], chip, maxindex=MAX_SOCK_NUM;
+	uint8_t s, chip, maxindex=MAX_SOCK_NUM;
 
 	// first check hardware compatibility
 	chip = W5100.getChip();
@@ -140,36 +285,12 @@ uint8_t EthernetClass::socketBeginMulticast(uint8_t protocol, IPAddress ip, uint
 	if (chip == 51) maxindex = 4; // W5100 chip never supports more than 4 sockets
 #endif
 	//Serial.printf("W5000socket begin, protocol=%d, port=%d\n", protocol, port);
-	SPI.beginTransaction(SPI_ETHERNET_SETTINGS);
-	// look at all the hardware sockets, use any that are closed (unused)
-	for (s=0; s < maxindex; s++) {
-		status[s] = W5100.readSnSR(s);
-		if (status[s] == SnSR::CLOSED) goto makesocket;
-	}
-	//Serial.printf("W5000socket step2\n");
-	// as a last resort, forcibly close any already closing
-	for (s=0; s < maxindex; s++) {
-		uint8_t stat = status[s];
-		if (stat == SnSR::LAST_ACK) goto closemakesocket;
-		if (stat == SnSR::TIME_WAIT) goto closemakesocket;
-		if (stat == SnSR::FIN_WAIT) goto closemakesocket;
-		if (stat == SnSR::CLOSING) goto closemakesocket;
-	}
-#if 0
-	Serial.printf("W5000socket step3\n");
-	// next, use any that are effectively closed
-	for (s=0; s < MAX_SOCK_NUM; s++) {
-		uint8_t stat = status[s];
-		// TODO: this also needs to check if no more data
-		if (stat == SnSR::CLOSE_WAIT) goto closemakesocket;
+	W5100.beginTransaction();
+	s = socketAllocate(maxindex);
+	if (s >= MAX_SOCK_NUM) {
+		W5100.endTransaction();
+		return MAX_SOCK_NUM; // all sockets are in use
 	}
-#endif
-	SPI.endTransaction();
-	return MAX_SOCK_NUM; // all sockets are in use
-closemakesocket:
-	//Serial.printf("W5000socket close\n");
-	W5100.execCmdSn(s, Sock_CLOSE);
-makesocket:
 	//Serial.printf("W5000socket %d\n", s);
 	EthernetServer::server_port[s] = 0;
 	delayMicroseconds(250); // TODO: is this needed??
@@ -191,32 +312,143 @@ makesocket:
     	W5100.writeSnDPORT(s, port);
     	W5100.writeSnDHAR(s, mac);
 	W5100.execCmdSn(s, Sock_OPEN);
-	state[s].RX_RSR = 0;
+	reset_state(s);
 	state[s].RX_RD  = W5100.readSnRX_RD(s); // always zero?
-	state[s].RX_inc = 0;
-	state[s].TX_FSR = 0;
 	//Serial.printf("W5000socket prot=%d, RX_RD=%d\n", W5100.readSnMR(s), state[s].RX_RD);
-	SPI.endTransaction();
+	W5100.endTransaction();
 	return s;
 }
+
+// Open socket 0, the only one which can, in MACRAW mode.  It gets every
+// Ethernet frame the other sockets don't take, each behind a 2 byte
+// length (which counts itself).
+uint8_t EthernetClass::socketBeginMACRAW()
+{
+	if (!W5100.getChip()) return MAX_SOCK_NUM;
+	W5100.beginTransaction();
+	if ((reserved & 1) || ((allocated & 1) && W5100.readSnSR(0) != SnSR::CLOSED)) {
+		W5100.endTransaction();
+		return MAX_SOCK_NUM; // socket 0 is in use
+	}
+	allocated |= 1;
+	EthernetServer::server_port[0] = 0;
+	W5100.writeSnMR(0, SnMR::MACRAW);
+	W5100.writeSnIR(0, 0xFF);
+	W5100.execCmdSn(0, Sock_OPEN);
+	reset_state(0);
+	state[0].RX_RD  = W5100.readSnRX_RD(0);
+	W5100.endTransaction();
+	return 0;
+}
+
+static uint16_t ip_checksum(const uint8_t *p, uint8_t len)
+{
+	uint32_t sum = 0;
+	for (uint8_t i=0; i < len; i += 2) {
+		sum += (p[i] << 8) | p[i+1];
+	}
+	sum = (sum >> 16) + (sum & 0xFFFF);
+	sum += sum >> 16;
+	return ~sum;
+}
+
+// Send an IGMPv2 membership report or leave group message for group
+// from a MACRAW socket.  UDP multicast sockets have the chip do this,
+// MACRAW sockets must build the whole frame themselves.
+bool EthernetClass::socketSendIGMP(uint8_t s, uint8_t type, IPAddress group)
+{
+	uint8_t frame[60]; // minimum Ethernet frame
+	// Leave messages go to all routers, reports to the group itself
+	IPAddress dest = (type == IGMP_LEAVE) ? IPAddress(224,0,0,2) : group;
+	uint8_t *ip = frame + 14;
+	uint8_t *igmp = ip + 24;
+	uint16_t sum;
+
+	memset(frame, 0, sizeof(frame));
+	frame[0] = 0x01;
+	frame[2] = 0x5E;
+	frame[3] = dest[1] & 0x7F;
+	frame[4] = dest[2];
+	frame[5] = dest[3];
+	frame[12] = 0x08; // IPv4
+	ip[0] = 0x46;  // 24 byte header, with the router alert option
+	ip[1] = 0xC0;  // internetwork control
+	ip[3] = 24 + 8;
+	ip[8] = 1;     // TTL, IGMP stays on the local network
+	ip[9] = 2;     // IGMP
+	memcpy(ip + 16, dest.raw_address(), 4);
+	ip[20] = 0x94; // router alert
+	ip[21] = 0x04;
+	igmp[0] = type;
+	memcpy(igmp + 4, group.raw_address(), 4);
+	sum = ip_checksum(igmp, 8);
+	igmp[2] = sum >> 8;
+	igmp[3] = sum;
+
+	W5100.beginTransaction();
+	W5100.getMACAddress(frame + 6);
+	W5100.getIPAddress(ip + 12);
+	sum = ip_checksum(ip, 24);
+	ip[10] = sum >> 8;
+	ip[11] = sum;
+	write_data(s, 0, frame, sizeof(frame));
+	W5100.execCmdSn(s, Sock_SEND);
+	while ( (W5100.readSnIR(s) & SnIR::SEND_OK) != SnIR::SEND_OK ) {
+		if ( W5100.readSnSR(s) == SnSR::CLOSED ) {
+			W5100.endTransaction();
+			return false;
+		}
+		W5100.endTransaction();
+		yield();
+		W5100.beginTransaction();
+	}
+	W5100.writeSnIR(s, SnIR::SEND_OK);
+	W5100.endTransaction();
+	return true;
+}
+
 // Return the socket's status
 //
 uint8_t EthernetClass::socketStatus(uint8_t s)
 {
-	SPI.beginTransaction(SPI_ETHERNET_SETTINGS);
+	W5100.beginTransaction();
 	uint8_t status = W5100.readSnSR(s);
-	SPI.endTransaction();
+	W5100.endTransaction();
 	return status;
 }
 
+// Status of all sockets, reading only those which signalled a change
+// since the last scan.  Returns the signalled sockets as a bitmask.
+//
+uint8_t EthernetClass::socketScan(uint8_t *status)
+{
+	W5100.beginTransaction();
+	uint8_t signalled = W5100.scanSockets(status);
+	W5100.endTransaction();
+	return signalled;
+}
+
 // Immediately close.  If a TCP connection is established, the
 // remote host is left unaware we closed.
 //
 void EthernetClass::socketClose(uint8_t s)
 {
-	SPI.beginTransaction(SPI_ETHERNET_SETTINGS);
+	W5100.beginTransaction();
 	W5100.execCmdSn(s, Sock_CLOSE);
-	SPI.endTransaction();
+	W5100.endTransaction();
+	allocated &= ~(1 << s);
+	reserved &= ~(1 << s);
+}
+
+
+// Have the chip check an idle connection is still alive.  Only works
+// after some data has been sent.  If the other end doesn't answer, the
+// socket times out and closes.
+void EthernetClass::socketSendKeepAlive(uint8_t s)
+{
+	W5100.beginTransaction();
+	W5100.execCmdSn(s, Sock_SEND_KEEP);
+	W5100.endTransaction();
 }
 
 
@@ -224,13 +456,13 @@ void EthernetClass::socketClose(uint8_t s)
 //
 uint8_t EthernetClass::socketListen(uint8_t s)
 {
-	SPI.beginTransaction(SPI_ETHERNET_SETTINGS);
+	W5100.beginTransaction();
 	if (W5100.readSnSR(s) != SnSR::INIT) {
-		SPI.endTransaction();
+		W5100.endTransaction();
 		return 0;
 	}
 	W5100.execCmdSn(s, Sock_LISTEN);
-	SPI.endTransaction();
+	W5100.endTransaction();
 	return 1;
 }
 
@@ -240,11 +472,10 @@ uint8_t EthernetClass::socketListen(uint8_t s)
 void EthernetClass::socketConnect(uint8_t s, uint8_t * addr, uint16_t port)
 {
 	// set destination IP
-	SPI.beginTransaction(SPI_ETHERNET_SETTINGS);
-	W5100.writeSnDIPR(s, addr);
-	W5100.writeSnDPORT(s, port);
+	W5100.beginTransaction();
+	W5100.writeSnDEST(s, addr, port);
 	W5100.execCmdSn(s, Sock_CONNECT);
-	SPI.endTransaction();
+	W5100.endTransaction();
 }
 
 
@@ -253,9 +484,9 @@ void EthernetClass::socketConnect(uint8_t s, uint8_t * addr, uint16_t port)
 //
 void EthernetClass::socketDisconnect(uint8_t s)
 {
-	SPI.beginTransaction(SPI_ETHERNET_SETTINGS);
+	W5100.beginTransaction();
 	W5100.execCmdSn(s, Sock_DISCON);
-	SPI.endTransaction();
+	W5100.endTransaction();
 }
 
 
@@ -268,51 +499,92 @@ void EthernetClass::socketDisconnect(uint8_t s)
 //static uint16_t getSnRX_RSR(uint8_t s)
 uint16_t getSnRX_RSR(uint8_t s)
 {
-#if 1
-        uint16_t val, prev;
-
-        prev = W5100.readSnRX_RSR(s);
-        while (1) {
-                val = W5100.readSnRX_RSR(s);
-                if (val == prev) {
-			return val;
-		}
-                prev = val;
-        }
-#else
-	uint16_t val = W5100.readSnRX_RSR(s);
-	return val;
-#endif
+	return W5100.readSnRX_RSRStable(s);
 }
 
 //static void read_data(uint8_t s, uint16_t src, uint8_t *dst, uint16_t len)
 void read_data(uint8_t s, uint16_t src, uint8_t *dst, uint16_t len)
 {
-	uint16_t size;
-	uint16_t src_mask;
-	uint16_t src_ptr;
-
 	//Serial.printf("read_data, len=%d, at:%d\n", len, src);
-	src_mask = (uint16_t)src & W5100.SMASK;
-	src_ptr = W5100.RBASE(s) + src_mask;
+	W5100.readSnRX(s, src, dst, len);
+}
 
-	if (W5100.hasOffsetAddressMapping() || src_mask + len <= W5100.SSIZE) {
-		W5100.read(src_ptr, dst, len);
-	} else {
-		size = W5100.SSIZE - src_mask;
-		W5100.read(src_ptr, dst, size);
-		dst += size;
-		W5100.read(W5100.RBASE(s), dst, len - size);
+#ifdef ETHERNET_READ_AHEAD
+// Number of bytes at ptr which are in the read-ahead copy
+static uint16_t read_ahead_avail(uint8_t s, uint16_t ptr)
+{
+	uint16_t n = ptr - state[s].RA_ptr;
+	if (n >= state[s].RA_len) return 0;
+	return state[s].RA_len - n;
+}
+
+// Copy received data, using the read-ahead copy for small reads.  Only
+// received (RX_RSR) bytes are read ahead, and the chip doesn't change
+// those until RX_RD moves past them.
+static void recv_data(uint8_t s, uint16_t ptr, uint8_t *dst, uint16_t len)
+{
+	if (read_ahead_avail(s, ptr) < len) {
+		if (len >= ETHERNET_READ_AHEAD) {
+			read_data(s, ptr, dst, len);
+			return;
+		}
+		uint16_t n = state[s].RX_RSR;
+		if (n > ETHERNET_READ_AHEAD) n = ETHERNET_READ_AHEAD;
+		read_data(s, ptr, state[s].RA_buf, n);
+		state[s].RA_ptr = ptr;
+		state[s].RA_len = n;
 	}
+	memcpy(dst, state[s].RA_buf + (uint16_t)(ptr - state[s].RA_ptr), len);
+}
+
+// RX_RD has moved to ptr.  Once it is past the read-ahead copy, forget
+// the copy: the 16 bit pointer wraps, and 64K later the stale bytes
+// would seem to be at RX_RD again.
+static void read_ahead_seek(uint8_t s, uint16_t ptr)
+{
+	if (!read_ahead_avail(s, ptr)) state[s].RA_len = 0;
+}
+#else
+#define recv_data(s, ptr, dst, len) read_data(s, ptr, dst, len)
+#define read_ahead_seek(s, ptr)
+#endif
+
+// How many consumed bytes to collect before Sock_RECV gives them back
+// to the chip.  Fewer commands save SPI traffic, but TCP advertises only
+// the free buffer space as its window.  1/8 of the buffer (256 bytes
+// with 2K buffers) keeps the window open, and when the buffer is more
+// than 3/4 full the sender is about to stall, so give space back sooner.
+static uint16_t recv_threshold(uint8_t s)
+{
+	uint16_t size = W5100.RXSIZE(s);
+	// RX_RSR + RX_inc is what the chip holds, it doesn't change until Sock_RECV
+	if (state[s].RX_RSR + state[s].RX_inc > size - (size >> 2)) {
+		return size >> 5;
+	}
+	return size >> 3;
 }
 
 // Receive data.  Returns size, or -1 for no data, or 0 if connection closed
 //
 int EthernetClass::socketRecv(uint8_t s, uint8_t *buf, int16_t len)
 {
+#ifdef ETHERNET_READ_AHEAD
+	// Served entirely from RAM when the data is already read ahead and
+	// taking it doesn't need a Sock_RECV command yet
+	if (len > 0 && len < state[s].RX_RSR &&
+	  state[s].RX_inc + len < recv_threshold(s) &&
+	  read_ahead_avail(s, state[s].RX_RD) >= (uint16_t)len) {
+		if (buf) recv_data(s, state[s].RX_RD, buf, len);
+		state[s].RX_RD += len;
+		read_ahead_seek(s, state[s].RX_RD);
+		state[s].RX_RSR -= len;
+		state[s].RX_inc += len;
+		return len;
+	}
+#endif
 	// Check how much data is available
 	int ret = state[s].RX_RSR;
-	SPI.beginTransaction(SPI_ETHERNET_SETTINGS);
+	W5100.beginTransaction();
 	if (ret < len) {
 		uint16_t rsr = getSnRX_RSR(s);
 		ret = rsr - state[s].RX_inc;
@@ -334,35 +606,45 @@ int EthernetClass::socketRecv(uint8_t s, uint8_t *buf, int16_t len)
 	} else {
 		if (ret > len) ret = len; // more data available than buffer length
 		uint16_t ptr = state[s].RX_RD;
-		if (buf) read_data(s, ptr, buf, ret);
+		if (buf) recv_data(s, ptr, buf, ret);
 		ptr += ret;
 		state[s].RX_RD = ptr;
+		read_ahead_seek(s, ptr);
 		state[s].RX_RSR -= ret;
-		uint16_t inc = state[s].RX_inc + ret;
-		if (inc >= 250 || state[s].RX_RSR == 0) {
+		state[s].RX_inc += ret;
+		if (state[s].RX_inc >= recv_threshold(s) || state[s].RX_RSR == 0) {
 			state[s].RX_inc = 0;
+			state[s].RECV_count++;
+			// the previous Sock_RECV must have taken its RX_RD first,
+			// but don't wait for this one, the next RX_RSR read does
+			W5100.cmdSnWait(s);
 			W5100.writeSnRX_RD(s, ptr);
-			W5100.execCmdSn(s, Sock_RECV);
+			W5100.execCmdSnAsync(s, Sock_RECV);
 			//Serial.printf("Sock_RECV cmd, RX_RD=%d, RX_RSR=%d\n",
 			//  state[s].RX_RD, state[s].RX_RSR);
-		} else {
-			state[s].RX_inc = inc;
 		}
 	}
-	SPI.endTransaction();
+	W5100.endTransaction();
 	//Serial.printf("socketRecv, ret=%d\n", ret);
 	return ret;
 }
 
+uint16_t EthernetClass::socketRecvCommands(uint8_t s)
+{
+	return state[s].RECV_count;
+}
+
 uint16_t EthernetClass::socketRecvAvailable(uint8_t s)
 {
 	uint16_t ret = state[s].RX_RSR;
 	if (ret == 0) {
-		SPI.beginTransaction(SPI_ETHERNET_SETTINGS);
+		W5100.beginTransaction();
 		uint16_t rsr = getSnRX_RSR(s);
-		SPI.endTransaction();
+		W5100.endTransaction();
 		ret = rsr - state[s].RX_inc;
 		state[s].RX_RSR = ret;
+		// nothing left, so the next data will be signalled by the chip
+		if (ret == 0) W5100.clearSnEvents(s, SnIR::RECV);
 		//Serial.printf("sockRecvAvailable s=%d, RX_RSR=%d\n", s, ret);
 	}
 	return ret;
@@ -373,14 +655,126 @@ uint16_t EthernetClass::socketRecvAvailable(uint8_t s)
 uint8_t EthernetClass::socketPeek(uint8_t s)
 {
 	uint8_t b;
-	SPI.beginTransaction(SPI_ETHERNET_SETTINGS);
 	uint16_t ptr = state[s].RX_RD;
-	W5100.read((ptr & W5100.SMASK) + W5100.RBASE(s), &b, 1);
-	SPI.endTransaction();
+#ifdef ETHERNET_READ_AHEAD
+	if (read_ahead_avail(s, ptr)) {
+		return state[s].RA_buf[ptr - state[s].RA_ptr];
+	}
+#endif
+	W5100.beginTransaction();
+	W5100.readSnRX(s, ptr, &b, 1);
+	W5100.endTransaction();
 	return b;
 }
 
 
+// copy received data starting offset bytes ahead, without consuming it
+//
+uint16_t EthernetClass::socketPeek(uint8_t s, uint16_t offset, uint8_t *buf, uint16_t len)
+{
+	uint16_t avail = socketRecvAvailable(s);
+	if (offset >= avail) return 0;
+	if (len > avail - offset) len = avail - offset;
+	uint16_t ptr = state[s].RX_RD + offset;
+#ifdef ETHERNET_READ_AHEAD
+	if (read_ahead_avail(s, ptr) >= len) {
+		memcpy(buf, state[s].RA_buf + (uint16_t)(ptr - state[s].RA_ptr), len);
+		return len;
+	}
+#endif
+	W5100.beginTransaction();
+	read_data(s, ptr, buf, len);
+	W5100.endTransaction();
+	return len;
+}
+
+// Find the next UDP datagram from ip and port and take its header.
+// Other datagrams are passed over by moving RX_RD, only their headers
+// are read.  The space goes back to the chip as socketRecv() would.
+//
+bool EthernetClass::socketRecvUDPHeader(uint8_t s, uint8_t *head, const uint8_t *ip, uint16_t port)
+{
+	bool found = false;
+	bool anyip = (ip[0] | ip[1] | ip[2] | ip[3]) == 0;
+	W5100.beginTransaction();
+	if (state[s].RX_RSR < 8) {
+		state[s].RX_RSR = getSnRX_RSR(s) - state[s].RX_inc;
+	}
+	while (state[s].RX_RSR >= 8) {
+		recv_data(s, state[s].RX_RD, head, 8);
+		uint16_t len = 8;
+		if ((anyip || memcmp(head, ip, 4) == 0) &&
+		  (port == 0 || port == ((head[4] << 8) | head[5]))) {
+			found = true;
+		} else {
+			len += (head[6] << 8) | head[7];
+			if (len > state[s].RX_RSR) len = state[s].RX_RSR;
+		}
+		state[s].RX_RD += len;
+		state[s].RX_RSR -= len;
+		state[s].RX_inc += len;
+		if (found) break;
+	}
+	read_ahead_seek(s, state[s].RX_RD);
+	if (state[s].RX_inc && (state[s].RX_inc >= recv_threshold(s) || state[s].RX_RSR == 0)) {
+		state[s].RX_inc = 0;
+		state[s].RECV_count++;
+		W5100.cmdSnWait(s);
+		W5100.writeSnRX_RD(s, state[s].RX_RD);
+		W5100.execCmdSnAsync(s, Sock_RECV);
+	}
+	W5100.endTransaction();
+	return found;
+}
+
+// Receive whole UDP datagrams, each with the chip's 8 byte header (IP,
+// port, length), straight from the RX buffer.  All in one transaction,
+// and the space is returned to the chip with one Sock_RECV at the end.
+// Datagrams not from ip and port are passed over, as socketRecvUDPHeader()
+// does.
+//
+uint8_t EthernetClass::socketRecvPackets(uint8_t s, EthernetUDPPacket *packets, uint8_t count, const uint8_t *ip, uint16_t port)
+{
+	uint8_t n = 0;
+	bool anyip = (ip[0] | ip[1] | ip[2] | ip[3]) == 0;
+	W5100.beginTransaction();
+	// MACRAW frames have no UDP header to go by
+	if ((W5100.readSnMR(s) & 0x0F) == SnMR::MACRAW) {
+		W5100.endTransaction();
+		return 0;
+	}
+	uint16_t avail = getSnRX_RSR(s) - state[s].RX_inc;
+	uint16_t ptr = state[s].RX_RD;
+	while (n < count && avail >= 8) {
+		uint8_t head[8];
+		read_data(s, ptr, head, 8);
+		uint16_t len = (head[6] << 8) | head[7];
+		if (len > avail - 8) break; // not all there yet
+		if ((anyip || memcmp(head, ip, 4) == 0) &&
+		  (port == 0 || port == ((head[4] << 8) | head[5]))) {
+			EthernetUDPPacket *p = packets + n++;
+			p->remoteIP = head;
+			p->remotePort = (head[4] << 8) | head[5];
+			p->length = len;
+			if (p->data) read_data(s, ptr + 8, p->data, len < p->size ? len : p->size);
+		}
+		ptr += 8 + len;
+		avail -= 8 + len;
+	}
+	state[s].RX_RSR = avail;
+	if (ptr != state[s].RX_RD) {
+		state[s].RX_RD = ptr;
+		read_ahead_seek(s, ptr);
+		state[s].RX_inc = 0;
+		state[s].RECV_count++;
+		W5100.cmdSnWait(s);
+		W5100.writeSnRX_RD(s, ptr);
+		W5100.execCmdSnAsync(s, Sock_RECV);
+	}
+	W5100.endTransaction();
+	return n;
+}
+
 
 /*****************************************/
 /*    Socket Data Transmit Functions     */
@@ -408,21 +802,80 @@ void write_data(uint8_t s, uint16_t data_offset, const uint8_t *data, uint16_t l
 {
 	uint16_t ptr = W5100.readSnTX_WR(s);
 	ptr += data_offset;
-	uint16_t offset = ptr & W5100.SMASK;
-	uint16_t dstAddr = offset + W5100.SBASE(s);
+	W5100.writeSnTX(s, ptr, data, len);
+	ptr += len;
+	// a pipelined Sock_SEND may not have taken the old Sn_TX_WR yet
+	W5100.cmdSnWait(s);
+	W5100.writeSnTX_WR(s, ptr);
+}
 
-	if (W5100.hasOffsetAddressMapping() || offset + len <= W5100.SSIZE) {
-		W5100.write(dstAddr, data, len);
-	} else {
-		// Wrap around circular buffer
-		uint16_t size = W5100.SSIZE - offset;
-		W5100.write(dstAddr, data, size);
-		W5100.write(W5100.SBASE(s), data + size, len - size);
+
+// Like write_data() for several pieces (e.g. a header and a payload)
+// placed back to back.  Sn_TX_WR is read and written only once.
+// Returns the total number of bytes written.
+uint16_t write_datav(uint8_t s, uint16_t data_offset, const socket_iov_t *iov, uint8_t count)
+{
+	uint16_t ptr = W5100.readSnTX_WR(s);
+	uint16_t start;
+	ptr += data_offset;
+	start = ptr;
+	for (uint8_t i=0; i < count; i++) {
+		W5100.writeSnTX(s, ptr, iov[i].data, iov[i].len);
+		ptr += iov[i].len;
 	}
-	ptr += len;
+	W5100.cmdSnWait(s);
 	W5100.writeSnTX_WR(s, ptr);
+	return ptr - start;
+}
+
+// Issue Sock_SEND for everything written to the TX buffer, inside a SPI
+// transaction.  Returns false if the connection is closed.
+static bool send_written(uint8_t s)
+{
+	state[s].TX_pending = 0;
+#ifdef ETHERNET_PIPELINED_SEND
+	// The data was copied while the previous segment was still being
+	// sent.  Only that previous Sock_SEND must finish before the next
+	// one, so wait for its SEND_OK here instead of after our own.
+	if (sending & (1 << s)) {
+		while ( (W5100.readSnIR(s) & SnIR::SEND_OK) != SnIR::SEND_OK ) {
+			if ( W5100.readSnSR(s) == SnSR::CLOSED ) {
+				sending &= ~(1 << s);
+				return false;
+			}
+			W5100.endTransaction();
+			yield();
+			W5100.beginTransaction();
+		}
+		W5100.writeSnIR(s, SnIR::SEND_OK);
+	}
+	W5100.execCmdSnAsync(s, Sock_SEND);
+	sending |= 1 << s;
+	return true;
+#else
+	W5100.execCmdSn(s, Sock_SEND);
+
+	/* +2008.01 bj */
+	while ( (W5100.readSnIR(s) & SnIR::SEND_OK) != SnIR::SEND_OK ) {
+		/* m2008.01 [bj] : reduce code */
+		if ( W5100.readSnSR(s) == SnSR::CLOSED ) {
+			return false;
+		}
+		W5100.endTransaction();
+		yield();
+		W5100.beginTransaction();
+	}
+	/* +2008.01 bj */
+	W5100.writeSnIR(s, SnIR::SEND_OK);
+	return true;
+#endif
 }
 
+// Coalesced data has waited long enough
+static bool send_due(uint8_t s)
+{
+	return (uint16_t)((uint16_t)millis() - state[s].TX_since) >= ETHERNET_COALESCE_MS;
+}
 
 /**
  * @brief	This function used to send the data in TCP mode
@@ -434,18 +887,20 @@ uint16_t EthernetClass::socketSend(uint8_t s, const uint8_t * buf, uint16_t len)
 	uint16_t ret=0;
 	uint16_t freesize=0;
 
-	if (len > W5100.SSIZE) {
-		ret = W5100.SSIZE; // check size not to exceed MAX size.
+	if (len > W5100.TXSIZE(s)) {
+		ret = W5100.TXSIZE(s); // check size not to exceed MAX size.
 	} else {
 		ret = len;
 	}
 
 	// if freebuf is available, start.
 	do {
-		SPI.beginTransaction(SPI_ETHERNET_SETTINGS);
-		freesize = getSnTX_FSR(s);
-		status = W5100.readSnSR(s);
-		SPI.endTransaction();
+		W5100Class::snstatus_t st;
+		W5100.beginTransaction();
+		W5100.readSnStatus(s, &st, state[s].TX_FSR);
+		W5100.endTransaction();
+		state[s].TX_FSR = freesize = st.TX_FSR;
+		status = st.SR;
 		if ((status != SnSR::ESTABLISHED) && (status != SnSR::CLOSE_WAIT)) {
 			ret = 0;
 			break;
@@ -454,37 +909,82 @@ uint16_t EthernetClass::socketSend(uint8_t s, const uint8_t * buf, uint16_t len)
 	} while (freesize < ret);
 
 	// copy data
-	SPI.beginTransaction(SPI_ETHERNET_SETTINGS);
+	W5100.beginTransaction();
 	write_data(s, 0, (uint8_t *)buf, ret);
-	W5100.execCmdSn(s, Sock_SEND);
+	state[s].TX_FSR -= ret;
+	if (!send_written(s)) ret = 0;
+	W5100.endTransaction();
+	return ret;
+}
 
-	/* +2008.01 bj */
-	while ( (W5100.readSnIR(s) & SnIR::SEND_OK) != SnIR::SEND_OK ) {
-		/* m2008.01 [bj] : reduce code */
-		if ( W5100.readSnSR(s) == SnSR::CLOSED ) {
-			SPI.endTransaction();
-			return 0;
-		}
-		SPI.endTransaction();
-		yield();
-		SPI.beginTransaction(SPI_ETHERNET_SETTINGS);
+// Like socketSend(), but on sockets with coalescing the data only goes
+// into the TX buffer.  Sn_TX_FSR is read only when the free space known
+// from before may be too small.
+uint16_t EthernetClass::socketWrite(uint8_t s, const uint8_t * buf, uint16_t len)
+{
+	if (len == 0) return 0;
+	uint16_t size = W5100.TXSIZE(s);
+	if (size > ETHERNET_COALESCE_SIZE) size = ETHERNET_COALESCE_SIZE;
+	if (!(coalescing & (1 << s)) || len >= size) {
+		if (!socketSendPending(s, false)) return 0;
+		return socketSend(s, buf, len);
+	}
+	if (state[s].TX_pending + len > size && !socketSendPending(s, false)) return 0;
+	if (!socketSendPending(s, true)) return 0;
+	W5100.beginTransaction();
+	// like socketSend(), nothing is taken once the connection is gone
+	uint8_t status = W5100.readSnSR(s);
+	if ((status != SnSR::ESTABLISHED) && (status != SnSR::CLOSE_WAIT)) {
+		W5100.endTransaction();
+		return 0;
+	}
+	if (state[s].TX_FSR < len && getSnTX_FSR(s) < len) {
+		// send what is waiting, then wait for space the usual way
+		bool ok = !state[s].TX_pending || send_written(s);
+		W5100.endTransaction();
+		return ok ? socketSend(s, buf, len) : 0;
+	}
+	write_data(s, 0, buf, len);
+	state[s].TX_FSR -= len;
+	if (state[s].TX_pending == 0) state[s].TX_since = millis();
+	state[s].TX_pending += len;
+	if ((buf[len - 1] == '\n' || state[s].TX_pending >= size) && !send_written(s)) len = 0;
+	W5100.endTransaction();
+	return len;
+}
+
+// Send the data socketWrite() left waiting.  With timed, only once it
+// has waited ETHERNET_COALESCE_MS.  Returns false if the connection is
+// closed.
+bool EthernetClass::socketSendPending(uint8_t s, bool timed)
+{
+	if (!state[s].TX_pending) return true;
+	if (timed && !send_due(s)) return true;
+	W5100.beginTransaction();
+	bool ok = send_written(s);
+	W5100.endTransaction();
+	return ok;
+}
+
+void EthernetClass::socketSetCoalescing(uint8_t s, bool on)
+{
+	if (on) {
+		coalescing |= 1 << s;
+	} else {
+		coalescing &= ~(1 << s);
+		socketSendPending(s, false);
 	}
-	/* +2008.01 bj */
-	W5100.writeSnIR(s, SnIR::SEND_OK);
-	SPI.endTransaction();
-	return ret;
 }
 
 uint16_t EthernetClass::socketSendAvailable(uint8_t s)
 {
-	uint8_t status=0;
-	uint16_t freesize=0;
-	SPI.beginTransaction(SPI_ETHERNET_SETTINGS);
-	freesize = getSnTX_FSR(s);
-	status = W5100.readSnSR(s);
-	SPI.endTransaction();
-	if ((status == SnSR::ESTABLISHED) || (status == SnSR::CLOSE_WAIT)) {
-		return freesize;
+	W5100Class::snstatus_t st;
+	W5100.beginTransaction();
+	W5100.readSnStatus(s, &st, state[s].TX_FSR);
+	W5100.endTransaction();
+	state[s].TX_FSR = st.TX_FSR;
+	if ((st.SR == SnSR::ESTABLISHED) || (st.SR == SnSR::CLOSE_WAIT)) {
+		return st.TX_FSR;
 	}
 	return 0;
 }
@@ -493,7 +993,7 @@ uint16_t EthernetClass::socketBufferData(uint8_t s, uint16_t offset, const uint8
 {
 	//Serial.printf("  bufferData, offset=%d, len=%d\n", offset, len);
 	uint16_t ret =0;
-	SPI.beginTransaction(SPI_ETHERNET_SETTINGS);
+	W5100.beginTransaction();
 	uint16_t txfree = getSnTX_FSR(s);
 	if (len > txfree) {
 		ret = txfree; // check size not to exceed MAX size.
@@ -501,7 +1001,7 @@ uint16_t EthernetClass::socketBufferData(uint8_t s, uint16_t offset, const uint8
 		ret = len;
 	}
 	write_data(s, offset, buf, ret);
-	SPI.endTransaction();
+	W5100.endTransaction();
 	return ret;
 }
 
@@ -511,16 +1011,15 @@ bool EthernetClass::socketStartUDP(uint8_t s, uint8_t* addr, uint16_t port)
 	  ((port == 0x00)) ) {
 		return false;
 	}
-	SPI.beginTransaction(SPI_ETHERNET_SETTINGS);
-	W5100.writeSnDIPR(s, addr);
-	W5100.writeSnDPORT(s, port);
-	SPI.endTransaction();
+	W5100.beginTransaction();
+	W5100.writeSnDEST(s, addr, port);
+	W5100.endTransaction();
 	return true;
 }
 
 bool EthernetClass::socketSendUDP(uint8_t s)
 {
-	SPI.beginTransaction(SPI_ETHERNET_SETTINGS);
+	W5100.beginTransaction();
 	W5100.execCmdSn(s, Sock_SEND);
 
 	/* +2008.01 bj */
@@ -528,21 +1027,76 @@ bool EthernetClass::socketSendUDP(uint8_t s)
 		if (W5100.readSnIR(s) & SnIR::TIMEOUT) {
 			/* +2008.01 [bj]: clear interrupt */
 			W5100.writeSnIR(s, (SnIR::SEND_OK|SnIR::TIMEOUT));
-			SPI.endTransaction();
+			W5100.endTransaction();
 			//Serial.printf("sendUDP timeout\n");
 			return false;
 		}
-		SPI.endTransaction();
+		W5100.endTransaction();
 		yield();
-		SPI.beginTransaction(SPI_ETHERNET_SETTINGS);
+		W5100.beginTransaction();
 	}
 
 	/* +2008.01 bj */
 	W5100.writeSnIR(s, SnIR::SEND_OK);
-	SPI.endTransaction();
+	W5100.endTransaction();
 
 	//Serial.printf("sendUDP ok\n");
 	/* Sent ok */
 	return true;
 }
 
+// Send a list of UDP datagrams.  Every payload that fits is copied into
+// the TX buffer first, back to back, and Sn_TX_WR is then moved to the
+// end of one datagram at a time for each Sock_SEND.  As each SEND_OK
+// frees space, more of the list is staged behind the ones in flight.
+// The destination is only written when it differs from the previous one.
+//
+uint8_t EthernetClass::socketSendPackets(uint8_t s, const EthernetUDPPacket *packets, uint8_t count)
+{
+	uint8_t sent = 0, staged = 0;
+	uint8_t addr[4];
+	uint16_t port = 0;
+	W5100.beginTransaction();
+	// Sn_DEST and Sn_TX_WR are rewritten below
+	W5100.cmdSnWait(s);
+	uint16_t txfree = getSnTX_FSR(s);
+	uint16_t ptr = W5100.readSnTX_WR(s);
+	uint16_t end = ptr;
+	while (sent < count) {
+		while (staged < count && packets[staged].length <= txfree) {
+			W5100.writeSnTX(s, end, packets[staged].data, packets[staged].length);
+			end += packets[staged].length;
+			txfree -= packets[staged].length;
+			staged++;
+		}
+		if (staged == sent) break; // larger than the whole buffer
+		const EthernetUDPPacket *p = packets + sent;
+		IPAddress ip = p->remoteIP;
+		uint8_t *a = ip.raw_address();
+		if ((a[0] | a[1] | a[2] | a[3]) == 0 || p->remotePort == 0) break;
+		if (sent == 0 || memcmp(a, addr, 4) != 0 || p->remotePort != port) {
+			W5100.writeSnDEST(s, a, p->remotePort);
+			memcpy(addr, a, 4);
+			port = p->remotePort;
+		}
+		ptr += p->length;
+		W5100.writeSnTX_WR(s, ptr);
+		W5100.execCmdSn(s, Sock_SEND);
+		while ((W5100.readSnIR(s) & SnIR::SEND_OK) != SnIR::SEND_OK) {
+			if (W5100.readSnIR(s) & SnIR::TIMEOUT) {
+				W5100.writeSnIR(s, (SnIR::SEND_OK|SnIR::TIMEOUT));
+				W5100.endTransaction();
+				return sent;
+			}
+			W5100.endTransaction();
+			yield();
+			W5100.beginTransaction();
+		}
+		W5100.writeSnIR(s, SnIR::SEND_OK);
+		txfree += p->length;
+		sent++;
+	}
+	state[s].TX_FSR = txfree;
+	W5100.endTransaction();
+	return sent;
+}
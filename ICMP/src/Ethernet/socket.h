@@ -8,6 +8,13 @@ uint16_t getSnRX_RSR(uint8_t s);
 void write_data(uint8_t s, uint16_t offset, const uint8_t *data, uint16_t len);
 void read_data(uint8_t s, uint16_t src, uint8_t *dst, uint16_t len);
 
+// One piece of data for write_datav()
+typedef struct {
+	const uint8_t *data;
+	uint16_t len;
+} socket_iov_t;
+uint16_t write_datav(uint8_t s, uint16_t offset, const socket_iov_t *iov, uint8_t count);
+
 
 #endif
 /* _SOCKET_H_ */
@@ -48,14 +48,33 @@
 
 
 
+// With ETHERNET_CHIP, init() only probes for the configured chip
+#if defined(ETHERNET_CHIP)
+#define PROBE_CHIP(n)  ((n) == ETHERNET_CHIP)
+#else
+#define PROBE_CHIP(n)  1
+#endif
+
 
 // W5100 controller instance
 uint8_t  W5100Class::chip = 0;
+uint8_t  W5100Class::cmdPending = 0;
+bool     W5100Class::fastStart = false;
+uint16_t W5100Class::initTime = 0;
+#if !defined(ETHERNET_CHIP)
 uint8_t  W5100Class::CH_BASE_MSB;
+#endif
 uint8_t  W5100Class::ss_pin = SS_PIN_DEFAULT;
-#ifdef ETHERNET_LARGE_BUFFERS
-uint16_t W5100Class::SSIZE = 2048;
-uint16_t W5100Class::SMASK = 0x07FF;
+#ifdef ETHERNET_CUSTOM_BUS
+static EthernetSPIBus spibus;
+EthernetBus *W5100Class::bus = &spibus;
+#endif
+uint8_t  W5100Class::sockSR[MAX_SOCK_NUM];
+uint8_t  W5100Class::sockIR[MAX_SOCK_NUM];
+uint8_t  W5100Class::txbufsize[MAX_SOCK_NUM];
+uint8_t  W5100Class::rxbufsize[MAX_SOCK_NUM];
+#ifndef ETHERNET_NO_REGISTER_SHADOW
+W5100Class::snshadow_t W5100Class::shadow[MAX_SOCK_NUM];
 #endif
 W5100Class W5100;
 
@@ -86,7 +105,8 @@ W5100Class W5100;
 uint8_t W5100Class::init(void)
 {
 	static bool initialized = false;
-	uint8_t i;
+	uint32_t start = millis();
+	uint16_t backoff = 1;
 
 	if (initialized) return 1;
 
@@ -98,90 +118,61 @@ uint8_t W5100Class::init(void)
 	// case maximum 560 ms pulse length.  This delay is meant to wait
 	// until the reset pulse is ended.  If your hardware has a shorter
 	// reset time, this can be edited or removed.
-	delay(560);
+	// With fast start (a chip which is already out of reset, like
+	// after waking from sleep) the chip is probed right away, and the
+	// same 560 ms are only spent retrying with growing delays if it
+	// doesn't answer.
+	if (!fastStart) delay(560);
 	//Serial.println("w5100 init");
 
-	SPI.begin();
-	initSS();
-	resetSS();
-	SPI.beginTransaction(SPI_ETHERNET_SETTINGS);
+	busBegin();
+	while (1) {
+		beginTransaction();
+		uint8_t found = probe();
+		endTransaction();
+		if (found) break;
+		uint32_t elapsed = millis() - start;
+		if (!fastStart || elapsed >= 560) {
+			initTime = elapsed;
+			return 0; // no known chip is responding :-(
+		}
+		// never wait past the 560 ms a reset pulse can last
+		delay(backoff < 560 - elapsed ? backoff : 560 - elapsed);
+		backoff <<= 1;
+	}
+	initTime = millis() - start;
+	initialized = true;
+	return 1; // successful init
+}
+
+// Detect which chip is present and set up its socket buffers
+uint8_t W5100Class::probe(void)
+{
+	uint8_t i, kb;
 
 	// Attempt W5200 detection first, because W5200 does not properly
 	// reset its SPI state when CS goes high (inactive).  Communication
 	// from detecting the other chips can leave the W5200 in a state
 	// where it won't recover, unless given a reset pulse.
-	if (isW5200()) {
+	if (PROBE_CHIP(52) && isW5200()) {
+#if !defined(ETHERNET_CHIP)
 		CH_BASE_MSB = 0x40;
-#ifdef ETHERNET_LARGE_BUFFERS
-#if MAX_SOCK_NUM <= 1
-		SSIZE = 16384;
-#elif MAX_SOCK_NUM <= 2
-		SSIZE = 8192;
-#elif MAX_SOCK_NUM <= 4
-		SSIZE = 4096;
-#else
-		SSIZE = 2048;
 #endif
-		SMASK = SSIZE - 1;
-#endif
-		for (i=0; i<MAX_SOCK_NUM; i++) {
-			writeSnRX_SIZE(i, SSIZE >> 10);
-			writeSnTX_SIZE(i, SSIZE >> 10);
-		}
-		for (; i<8; i++) {
-			writeSnRX_SIZE(i, 0);
-			writeSnTX_SIZE(i, 0);
-		}
 	// Try W5500 next.  Wiznet finally seems to have implemented
 	// SPI well with this chip.  It appears to be very resilient,
 	// so try it after the fragile W5200
-	} else if (isW5500()) {
+	} else if (PROBE_CHIP(55) && isW5500()) {
+#if !defined(ETHERNET_CHIP)
 		CH_BASE_MSB = 0x10;
-#ifdef ETHERNET_LARGE_BUFFERS
-#if MAX_SOCK_NUM <= 1
-		SSIZE = 16384;
-#elif MAX_SOCK_NUM <= 2
-		SSIZE = 8192;
-#elif MAX_SOCK_NUM <= 4
-		SSIZE = 4096;
-#else
-		SSIZE = 2048;
-#endif
-		SMASK = SSIZE - 1;
-		for (i=0; i<MAX_SOCK_NUM; i++) {
-			writeSnRX_SIZE(i, SSIZE >> 10);
-			writeSnTX_SIZE(i, SSIZE >> 10);
-		}
-		for (; i<8; i++) {
-			writeSnRX_SIZE(i, 0);
-			writeSnTX_SIZE(i, 0);
-		}
 #endif
 	// Try W5100 last.  This simple chip uses fixed 4 byte frames
 	// for every 8 bit access.  Terribly inefficient, but so simple
 	// it recovers from "hearing" unsuccessful W5100 or W5200
 	// communication.  W5100 is also the only chip without a VERSIONR
 	// register for identification, so we check this last.
-	} else if (isW5100()) {
+	} else if (PROBE_CHIP(51) && isW5100()) {
+#if !defined(ETHERNET_CHIP)
 		CH_BASE_MSB = 0x04;
-#ifdef ETHERNET_LARGE_BUFFERS
-#if MAX_SOCK_NUM <= 1
-		SSIZE = 8192;
-		writeTMSR(0x03);
-		writeRMSR(0x03);
-#elif MAX_SOCK_NUM <= 2
-		SSIZE = 4096;
-		writeTMSR(0x0A);
-		writeRMSR(0x0A);
-#else
-		SSIZE = 2048;
-		writeTMSR(0x55);
-		writeRMSR(0x55);
-#endif
-		SMASK = SSIZE - 1;
-#else
-		writeTMSR(0x55);
-		writeRMSR(0x55);
 #endif
 	// No hardware seems to be present.  Or it could be a W5200
 	// that's heard other SPI communication if its chip select
@@ -189,12 +180,165 @@ uint8_t W5100Class::init(void)
 	} else {
 		//Serial.println("no chip :-(");
 		chip = 0;
-		SPI.endTransaction();
-		return 0; // no known chip is responding :-(
+		return 0;
+	}
+
+	// W5200 only sets the IR2 bits scanSockets() relies on for sockets
+	// enabled in its IMR, which resets to 0
+	if (chipIs(52)) writeIMR2_W5200(0xFF);
+
+	// Share the buffer memory (16K on W5200/W5500, 8K on W5100)
+	// equally between the sockets.  setSnBufSize() can change this.
+	kb = 2;
+#ifdef ETHERNET_LARGE_BUFFERS
+#if MAX_SOCK_NUM <= 1
+	kb = 16;
+#elif MAX_SOCK_NUM <= 2
+	kb = 8;
+#elif MAX_SOCK_NUM <= 4
+	kb = 4;
+#endif
+	if (chipIs(51) && kb > 2) kb >>= 1;
+#endif
+	for (i=0; i<MAX_SOCK_NUM; i++) {
+		if (chipIs(51) && i >= 4) kb = 0;
+		txbufsize[i] = kb;
+		rxbufsize[i] = kb;
+	}
+	writeBufSizes();
+	return 1;
+}
+
+// Program the chip with the socket buffer sizes from txbufsize[] and
+// rxbufsize[].  W5100 packs 2 bits per socket into TMSR/RMSR.
+void W5100Class::writeBufSizes(void)
+{
+	uint8_t i;
+
+	if (chipIs(51)) {
+		uint8_t tmsr = 0, rmsr = 0;
+		for (i=0; i<MAX_SOCK_NUM && i<4; i++) {
+			tmsr |= log2kb(txbufsize[i]) << (i * 2);
+			rmsr |= log2kb(rxbufsize[i]) << (i * 2);
+		}
+		writeTMSR(tmsr);
+		writeRMSR(rmsr);
+		return;
+	}
+	for (i=0; i<MAX_SOCK_NUM; i++) {
+		writeSnRX_SIZE(i, rxbufsize[i]);
+		writeSnTX_SIZE(i, txbufsize[i]);
+	}
+	for (; i<8; i++) {
+		writeSnRX_SIZE(i, 0);
+		writeSnTX_SIZE(i, 0);
+	}
+}
+
+uint8_t W5100Class::log2kb(uint8_t kb)
+{
+	uint8_t n = 0;
+	while (kb > 1) {
+		kb >>= 1;
+		n++;
+	}
+	return n;
+}
+
+// Change one socket's TX and RX buffer sizes, in KB.  Sizes must be a
+// power of 2 and all sockets together must fit in the chip's 16K (8K
+// on W5100) for each direction; W5100 sockets need at least 1K.  The
+// socket must be closed.  On W5100 and W5200 the higher numbered
+// sockets' buffers move too (see SBASE), so they must be closed as
+// well.  Returns false if not possible.
+bool W5100Class::setSnBufSize(SOCKET s, uint8_t txkb, uint8_t rxkb)
+{
+	uint8_t total, txsum = 0, rxsum = 0;
+
+	if (!chip || s >= MAX_SOCK_NUM) return false;
+	// the pointer masks (size - 1) need a buffer
+	if (!txkb || !rxkb) return false;
+	if ((txkb & (txkb - 1)) || (rxkb & (rxkb - 1))) return false;
+	// every chip packs the buffers in socket order, so all higher
+	// numbered sockets' buffers move too
+	for (uint8_t i=s; i<MAX_SOCK_NUM; i++) {
+		if (readSnSR(i) != SnSR::CLOSED) return false;
+	}
+	if (chipIs(51)) {
+		if (s >= 4) return false;
+		total = 8;
+	} else {
+		total = 16;
+	}
+	for (uint8_t i=0; i<MAX_SOCK_NUM; i++) {
+		if (i == s) continue;
+		txsum += txbufsize[i];
+		rxsum += rxbufsize[i];
+	}
+	if (txsum + txkb > total || rxsum + rxkb > total) return false;
+	txbufsize[s] = txkb;
+	rxbufsize[s] = rxkb;
+	writeBufSizes();
+	return true;
+}
+
+// W5100 and W5200 place the socket buffers one after another, so a
+// socket's buffer starts after all the lower numbered sockets' buffers
+uint16_t W5100Class::SBASE(uint8_t socknum)
+{
+	uint16_t base = chipIs(51) ? 0x4000 : 0x8000;
+	for (uint8_t i=0; i<socknum; i++) base += TXSIZE(i);
+	return base;
+}
+
+uint16_t W5100Class::RBASE(uint8_t socknum)
+{
+	uint16_t base = chipIs(51) ? 0x6000 : 0xC000;
+	for (uint8_t i=0; i<socknum; i++) base += RXSIZE(i);
+	return base;
+}
+
+// Copy len bytes from socket s's RX buffer, starting at the free running
+// pointer ptr.  W5500 has a block per socket buffer and wraps the offset
+// itself; the others need the copy split at the end of the buffer.
+void W5100Class::readSnRX(SOCKET s, uint16_t ptr, uint8_t *buf, uint16_t len)
+{
+	if (chipIs(55)) {
+		read55(ptr, (s << 5) | 0x18, buf, len);
+		return;
+	}
+	uint16_t size = RXSIZE(s);
+	uint16_t offset = ptr & (size - 1);
+	uint16_t base = RBASE(s);
+
+	if (offset + len <= size) {
+		read(base + offset, buf, len);
+	} else {
+		uint16_t n = size - offset;
+		read(base + offset, buf, n);
+		read(base, buf + n, len - n);
+	}
+}
+
+// Copy len bytes into socket s's TX buffer at the free running pointer
+void W5100Class::writeSnTX(SOCKET s, uint16_t ptr, const uint8_t *buf, uint16_t len)
+{
+	if (chipIs(55)) {
+		write55(ptr, (s << 5) | 0x14, buf, len);
+		return;
+	}
+	uint16_t size = TXSIZE(s);
+	uint16_t offset = ptr & (size - 1);
+	uint16_t base = SBASE(s);
+
+	if (offset + len <= size) {
+		write(base + offset, buf, len);
+	} else {
+		// Wrap around circular buffer
+		uint16_t n = size - offset;
+		write(base + offset, buf, n);
+		write(base, buf + n, len - n);
 	}
-	SPI.endTransaction();
-	initialized = true;
-	return 1; // successful init
 }
 
 // Soft reset the Wiznet chip, by writing to its MR register reset bit
@@ -203,6 +347,13 @@ uint8_t W5100Class::softReset(void)
 	uint16_t count=0;
 
 	//Serial.println("Wiznet soft reset");
+#ifndef ETHERNET_NO_REGISTER_SHADOW
+	// reset returns all socket registers to their defaults
+	memset(shadow, 0, sizeof(shadow));
+#endif
+	cmdPending = 0;
+	memset(sockSR, 0xFF, sizeof(sockSR));
+	memset(sockIR, 0, sizeof(sockIR));
 	// write to reset bit
 	writeMR(0x80);
 	// then wait for soft reset to complete
@@ -269,6 +420,65 @@ uint8_t W5100Class::isW5500(void)
 	return 1;
 }
 
+void W5100Class::spiBegin()
+{
+	SPI.begin();
+	initSS();
+	resetSS();
+}
+
+void W5100Class::spiTransfer(const uint8_t *txbuf, uint8_t *rxbuf, uint16_t len)
+{
+	if (!rxbuf) {
+#ifdef SPI_HAS_TRANSFER_BUF
+		SPI.transfer(txbuf, NULL, len);
+#else
+		// TODO: copy 8 bytes at a time to a buffer and block transfer
+		for (uint16_t i=0; i < len; i++) {
+			SPI.transfer(txbuf ? txbuf[i] : 0);
+		}
+#endif
+		return;
+	}
+	// SPI.transfer() sends and receives in place
+	if (!txbuf) {
+		memset(rxbuf, 0, len);
+	} else if (txbuf != rxbuf) {
+		memcpy(rxbuf, txbuf, len);
+	}
+	SPI.transfer(rxbuf, len);
+}
+
+void EthernetSPIBus::begin()
+{
+	W5100Class::spiBegin();
+}
+
+void EthernetSPIBus::beginTransaction()
+{
+	SPI.beginTransaction(SPI_ETHERNET_SETTINGS);
+}
+
+void EthernetSPIBus::endTransaction()
+{
+	SPI.endTransaction();
+}
+
+void EthernetSPIBus::select()
+{
+	W5100Class::setSS();
+}
+
+void EthernetSPIBus::deselect()
+{
+	W5100Class::resetSS();
+}
+
+void EthernetSPIBus::transfer(const uint8_t *txbuf, uint8_t *rxbuf, uint16_t len)
+{
+	W5100Class::spiTransfer(txbuf, rxbuf, len);
+}
+
 W5100Linkstatus W5100Class::getLinkStatus()
 {
 	uint8_t phystatus;
@@ -276,15 +486,15 @@ W5100Linkstatus W5100Class::getLinkStatus()
 	if (!init()) return UNKNOWN;
 	switch (chip) {
 	  case 52:
-		SPI.beginTransaction(SPI_ETHERNET_SETTINGS);
+		beginTransaction();
 		phystatus = readPSTATUS_W5200();
-		SPI.endTransaction();
+		endTransaction();
 		if (phystatus & 0x20) return LINK_ON;
 		return LINK_OFF;
 	  case 55:
-		SPI.beginTransaction(SPI_ETHERNET_SETTINGS);
+		beginTransaction();
 		phystatus = readPHYCFGR_W5500();
-		SPI.endTransaction();
+		endTransaction();
 		if (phystatus & 0x01) return LINK_ON;
 		return LINK_OFF;
 	  default:
@@ -296,90 +506,59 @@ uint16_t W5100Class::write(uint16_t addr, const uint8_t *buf, uint16_t len)
 {
 	uint8_t cmd[8];
 
-	if (chip == 51) {
+	if (chipIs(51)) {
 		for (uint16_t i=0; i<len; i++) {
-			setSS();
-			SPI.transfer(0xF0);
-			SPI.transfer(addr >> 8);
-			SPI.transfer(addr & 0xFF);
+			busSelect();
+			cmd[0] = 0xF0;
+			cmd[1] = addr >> 8;
+			cmd[2] = addr & 0xFF;
+			cmd[3] = buf[i];
 			addr++;
-			SPI.transfer(buf[i]);
-			resetSS();
+			busTransfer(cmd, NULL, 4);
+			busDeselect();
 		}
-	} else if (chip == 52) {
-		setSS();
+	} else if (chipIs(52)) {
+		busSelect();
 		cmd[0] = addr >> 8;
 		cmd[1] = addr & 0xFF;
 		cmd[2] = ((len >> 8) & 0x7F) | 0x80;
 		cmd[3] = len & 0xFF;
-		SPI.transfer(cmd, 4);
-#ifdef SPI_HAS_TRANSFER_BUF
-		SPI.transfer(buf, NULL, len);
-#else
-		// TODO: copy 8 bytes at a time to cmd[] and block transfer
-		for (uint16_t i=0; i < len; i++) {
-			SPI.transfer(buf[i]);
-		}
-#endif
-		resetSS();
+		busTransfer(cmd, NULL, 4);
+		busTransfer(buf, NULL, len);
+		busDeselect();
 	} else { // chip == 55
-		setSS();
+		uint8_t ctrl;
 		if (addr < 0x100) {
 			// common registers 00nn
-			cmd[0] = 0;
-			cmd[1] = addr & 0xFF;
-			cmd[2] = 0x04;
-		} else if (addr < 0x8000) {
-			// socket registers  10nn, 11nn, 12nn, 13nn, etc
-			cmd[0] = 0;
-			cmd[1] = addr & 0xFF;
-			cmd[2] = ((addr >> 3) & 0xE0) | 0x0C;
-		} else if (addr < 0xC000) {
-			// transmit buffers  8000-87FF, 8800-8FFF, 9000-97FF, etc
-			//  10## #nnn nnnn nnnn
-			cmd[0] = addr >> 8;
-			cmd[1] = addr & 0xFF;
-			#if defined(ETHERNET_LARGE_BUFFERS) && MAX_SOCK_NUM <= 1
-			cmd[2] = 0x14;                       // 16K buffers
-			#elif defined(ETHERNET_LARGE_BUFFERS) && MAX_SOCK_NUM <= 2
-			cmd[2] = ((addr >> 8) & 0x20) | 0x14; // 8K buffers
-			#elif defined(ETHERNET_LARGE_BUFFERS) && MAX_SOCK_NUM <= 4
-			cmd[2] = ((addr >> 7) & 0x60) | 0x14; // 4K buffers
-			#else
-			cmd[2] = ((addr >> 6) & 0xE0) | 0x14; // 2K buffers
-			#endif
+			ctrl = 0x04;
 		} else {
-			// receive buffers
-			cmd[0] = addr >> 8;
-			cmd[1] = addr & 0xFF;
-			#if defined(ETHERNET_LARGE_BUFFERS) && MAX_SOCK_NUM <= 1
-			cmd[2] = 0x1C;                       // 16K buffers
-			#elif defined(ETHERNET_LARGE_BUFFERS) && MAX_SOCK_NUM <= 2
-			cmd[2] = ((addr >> 8) & 0x20) | 0x1C; // 8K buffers
-			#elif defined(ETHERNET_LARGE_BUFFERS) && MAX_SOCK_NUM <= 4
-			cmd[2] = ((addr >> 7) & 0x60) | 0x1C; // 4K buffers
-			#else
-			cmd[2] = ((addr >> 6) & 0xE0) | 0x1C; // 2K buffers
-			#endif
+			// socket registers  10nn, 11nn, 12nn, 13nn, etc
+			ctrl = ((addr >> 3) & 0xE0) | 0x0C;
+			addr &= 0xFF;
 		}
-		if (len <= 5) {
-			for (uint8_t i=0; i < len; i++) {
-				cmd[i + 3] = buf[i];
-			}
-			SPI.transfer(cmd, len + 3);
-		} else {
-			SPI.transfer(cmd, 3);
-#ifdef SPI_HAS_TRANSFER_BUF
-			SPI.transfer(buf, NULL, len);
-#else
-			// TODO: copy 8 bytes at a time to cmd[] and block transfer
-			for (uint16_t i=0; i < len; i++) {
-				SPI.transfer(buf[i]);
-			}
-#endif
+		write55(addr, ctrl, buf, len);
+	}
+	return len;
+}
+
+uint16_t W5100Class::write55(uint16_t offset, uint8_t ctrl, const uint8_t *buf, uint16_t len)
+{
+	uint8_t cmd[8];
+
+	busSelect();
+	cmd[0] = offset >> 8;
+	cmd[1] = offset & 0xFF;
+	cmd[2] = ctrl;
+	if (len <= 5) {
+		for (uint8_t i=0; i < len; i++) {
+			cmd[i + 3] = buf[i];
 		}
-		resetSS();
+		busTransfer(cmd, NULL, len + 3);
+	} else {
+		busTransfer(cmd, NULL, 3);
+		busTransfer(buf, NULL, len);
 	}
+	busDeselect();
 	return len;
 }
 
@@ -387,88 +566,235 @@ uint16_t W5100Class::read(uint16_t addr, uint8_t *buf, uint16_t len)
 {
 	uint8_t cmd[4];
 
-	if (chip == 51) {
+	if (chipIs(51)) {
 		for (uint16_t i=0; i < len; i++) {
-			setSS();
-			#if 1
-			SPI.transfer(0x0F);
-			SPI.transfer(addr >> 8);
-			SPI.transfer(addr & 0xFF);
-			addr++;
-			buf[i] = SPI.transfer(0);
-			#else
+			busSelect();
 			cmd[0] = 0x0F;
 			cmd[1] = addr >> 8;
 			cmd[2] = addr & 0xFF;
-			cmd[3] = 0;
-			SPI.transfer(cmd, 4); // TODO: why doesn't this work?
-			buf[i] = cmd[3];
 			addr++;
-			#endif
-			resetSS();
+			busTransfer(cmd, NULL, 3);
+			busTransfer(NULL, buf + i, 1);
+			busDeselect();
 		}
-	} else if (chip == 52) {
-		setSS();
+	} else if (chipIs(52)) {
+		busSelect();
 		cmd[0] = addr >> 8;
 		cmd[1] = addr & 0xFF;
 		cmd[2] = (len >> 8) & 0x7F;
 		cmd[3] = len & 0xFF;
-		SPI.transfer(cmd, 4);
-		memset(buf, 0, len);
-		SPI.transfer(buf, len);
-		resetSS();
+		busTransfer(cmd, NULL, 4);
+		busTransfer(NULL, buf, len);
+		busDeselect();
 	} else { // chip == 55
-		setSS();
+		uint8_t ctrl;
 		if (addr < 0x100) {
 			// common registers 00nn
-			cmd[0] = 0;
-			cmd[1] = addr & 0xFF;
-			cmd[2] = 0x00;
-		} else if (addr < 0x8000) {
-			// socket registers  10nn, 11nn, 12nn, 13nn, etc
-			cmd[0] = 0;
-			cmd[1] = addr & 0xFF;
-			cmd[2] = ((addr >> 3) & 0xE0) | 0x08;
-		} else if (addr < 0xC000) {
-			// transmit buffers  8000-87FF, 8800-8FFF, 9000-97FF, etc
-			//  10## #nnn nnnn nnnn
-			cmd[0] = addr >> 8;
-			cmd[1] = addr & 0xFF;
-			#if defined(ETHERNET_LARGE_BUFFERS) && MAX_SOCK_NUM <= 1
-			cmd[2] = 0x10;                       // 16K buffers
-			#elif defined(ETHERNET_LARGE_BUFFERS) && MAX_SOCK_NUM <= 2
-			cmd[2] = ((addr >> 8) & 0x20) | 0x10; // 8K buffers
-			#elif defined(ETHERNET_LARGE_BUFFERS) && MAX_SOCK_NUM <= 4
-			cmd[2] = ((addr >> 7) & 0x60) | 0x10; // 4K buffers
-			#else
-			cmd[2] = ((addr >> 6) & 0xE0) | 0x10; // 2K buffers
-			#endif
+			ctrl = 0x00;
 		} else {
-			// receive buffers
-			cmd[0] = addr >> 8;
-			cmd[1] = addr & 0xFF;
-			#if defined(ETHERNET_LARGE_BUFFERS) && MAX_SOCK_NUM <= 1
-			cmd[2] = 0x18;                       // 16K buffers
-			#elif defined(ETHERNET_LARGE_BUFFERS) && MAX_SOCK_NUM <= 2
-			cmd[2] = ((addr >> 8) & 0x20) | 0x18; // 8K buffers
-			#elif defined(ETHERNET_LARGE_BUFFERS) && MAX_SOCK_NUM <= 4
-			cmd[2] = ((addr >> 7) & 0x60) | 0x18; // 4K buffers
-			#else
-			cmd[2] = ((addr >> 6) & 0xE0) | 0x18; // 2K buffers
-			#endif
+			// socket registers  10nn, 11nn, 12nn, 13nn, etc
+			ctrl = ((addr >> 3) & 0xE0) | 0x08;
+			addr &= 0xFF;
 		}
-		SPI.transfer(cmd, 3);
-		memset(buf, 0, len);
-		SPI.transfer(buf, len);
-		resetSS();
+		read55(addr, ctrl, buf, len);
 	}
 	return len;
 }
 
+uint16_t W5100Class::read55(uint16_t offset, uint8_t ctrl, uint8_t *buf, uint16_t len)
+{
+	uint8_t cmd[3];
+
+	busSelect();
+	cmd[0] = offset >> 8;
+	cmd[1] = offset & 0xFF;
+	cmd[2] = ctrl;
+	busTransfer(cmd, NULL, 3);
+	busTransfer(NULL, buf, len);
+	busDeselect();
+	return len;
+}
+
 void W5100Class::execCmdSn(SOCKET s, SockCMD _cmd)
 {
+	execCmdSnAsync(s, _cmd);
+	// Wait for command to complete
+	cmdSnWait(s);
+}
+
+void W5100Class::execCmdSnAsync(SOCKET s, SockCMD _cmd)
+{
+	if (s >= MAX_SOCK_NUM) return;
+	// The chip only accepts a new command once the previous one is done
+	cmdSnWait(s);
 	// Send command to socket
 	writeSnCR(s, _cmd);
-	// Wait for command to complete
-	while (readSnCR(s)) ;
+	cmdPending |= 1 << s;
+	// Commands change the status without an interrupt
+	sockSR[s] = 0xFF;
+	if (_cmd == Sock_OPEN || _cmd == Sock_CLOSE) sockIR[s] = 0;
+#ifndef ETHERNET_NO_REGISTER_SHADOW
+	// A listening socket gets the remote address filled in by the
+	// chip when a client connects
+	if (_cmd == Sock_LISTEN) {
+		invalidateSnShadow(s, SHADOW_DIPR, 6); // DIPR + DPORT
+	}
+#endif
+}
+
+// Check, without blocking, whether the socket's last command is done
+bool W5100Class::cmdSnDone(SOCKET s)
+{
+	if (s >= MAX_SOCK_NUM || !(cmdPending & (1 << s))) return true;
+	if (readSnCR(s)) return false;
+	cmdPending &= ~(1 << s);
+	return true;
+}
+
+// Status which only changes along with a socket interrupt or a command.
+// The others (SYNSENT, FIN_WAIT, TIME_WAIT, etc) can move on silently.
+bool W5100Class::sockSRStable(uint8_t sr)
+{
+	switch (sr) {
+	case SnSR::CLOSED:
+	case SnSR::INIT:
+	case SnSR::LISTEN:
+	case SnSR::ESTABLISHED:
+	case SnSR::CLOSE_WAIT:
+	case SnSR::UDP:
+	case SnSR::IPRAW:
+	case SnSR::MACRAW:
+		return true;
+	}
+	return false;
+}
+
+uint8_t W5100Class::scanSockets(uint8_t *status)
+{
+	uint8_t s, sir, maxindex=MAX_SOCK_NUM, signalled=0;
+
+	if (chipIs(55)) {
+		sir = readSIR_W5500();
+	} else if (chipIs(52)) {
+		sir = readIR2_W5200();
+	} else {
+		sir = 0xFF; // W5100 has no summary, so read every socket
+	}
+#if MAX_SOCK_NUM > 4
+	if (chipIs(51)) maxindex = 4; // W5100 chip never supports more than 4 sockets
+#endif
+	for (s=0; s < maxindex; s++) {
+		if ((sir & (1 << s)) || !sockSRStable(sockSR[s])) {
+			uint8_t buf[2]; // Sn_IR, Sn_SR
+			readSn(s, 0x0002, buf, 2);
+			// SEND_OK and TIMEOUT are left for the send functions
+			uint8_t ev = buf[0] & (SnIR::CON | SnIR::DISCON | SnIR::RECV);
+			if (ev) {
+				writeSnIR(s, ev);
+				sockIR[s] |= ev;
+			}
+			if (sir & (1 << s)) signalled |= 1 << s;
+			// an unfinished command may still change it
+			sockSR[s] = (cmdPending & (1 << s)) ? 0xFF : buf[1];
+			status[s] = buf[1];
+		} else {
+			status[s] = sockSR[s];
+		}
+	}
+	return signalled;
+}
+
+#ifndef ETHERNET_NO_REGISTER_SHADOW
+// Write a socket register through its RAM shadow.  If the shadow says
+// the chip already holds this value, no SPI transfer is done at all.
+void W5100Class::writeSnShadow(SOCKET s, uint16_t addr, uint8_t slot, const uint8_t *buf, uint8_t len)
+{
+	if (s < MAX_SOCK_NUM) {
+		uint16_t mask = ((1 << len) - 1) << slot;
+		uint8_t *reg = shadow[s].reg + slot;
+		if ((shadow[s].valid & mask) == mask && memcmp(reg, buf, len) == 0) return;
+		memcpy(reg, buf, len);
+		shadow[s].valid |= mask;
+	}
+	writeSn(s, addr, (uint8_t *)buf, len);
+}
+#endif
+
+// Read Sn_RX_RSR, which the chip may change in the middle of our read.
+// On W5200 and W5500, RX_RSR, RX_RD and RX_WR are read in one burst and
+// the value is trusted when RX_RSR == RX_WR - RX_RD, so one frame is
+// usually enough.  W5100 has no burst frames: read twice until equal.
+uint16_t W5100Class::readSnRX_RSRStable(SOCKET s)
+{
+	uint16_t val, prev = 0;
+
+	// RX_RSR is only updated once a pending RECV has been processed
+	cmdSnWait(s);
+	if (chipIs(51)) {
+		prev = readSnRX_RSR(s);
+		while (1) {
+			val = readSnRX_RSR(s);
+			if (val == prev) return val;
+			prev = val;
+		}
+	}
+	for (uint8_t n=0; ; n++) {
+		uint8_t buf[6];
+		readSn(s, 0x0026, buf, 6);
+		val = (buf[0] << 8) | buf[1];
+		uint16_t rd = (buf[2] << 8) | buf[3];
+		uint16_t wr = (buf[4] << 8) | buf[5];
+		if ((uint16_t)(wr - rd) == val) return val;
+		// fall back to the read-twice rule
+		if (n > 0 && val == prev) return val;
+		prev = val;
+	}
+}
+
+// Read the socket's command, status, interrupt and buffer registers.  On
+// W5200 and W5500 they are contiguous, so everything from Sn_IR (or Sn_CR
+// with a command in flight) up to Sn_RX_WR comes in one burst.  RX_RSR
+// is checked against the RX pointers read in the same burst.  TX_FSR is
+// freed by remote ACKs at any time, but a value equal to txfsr, the
+// caller's last known TX_FSR, is trusted without reading it again.
+void W5100Class::readSnStatus(SOCKET s, snstatus_t *st, uint16_t txfsr)
+{
+	uint8_t buf[0x2B]; // Sn_CR up to Sn_RX_WR, buf[addr - 1]
+	uint16_t prev = 0;
+	uint16_t addr = 0x0002;
+
+	// With a command in flight (see execCmdSnAsync), Sn_CR is read in
+	// the same frame until the chip has accepted it
+	if (cmdPending & (1 << s)) addr = 0x0001;
+	if (chipIs(51)) {
+		do {
+			readSn(s, addr, buf + addr - 1, 0x0004 - addr);
+		} while (addr == 0x0001 && buf[0]);
+		st->IR = buf[1];
+		st->SR = buf[2];
+		st->TX_FSR = readSnTX_FSR(s);
+		st->TX_WR  = readSnTX_WR(s);
+		st->RX_RSR = readSnRX_RSRStable(s);
+		st->RX_RD  = readSnRX_RD(s);
+	} else {
+		for (uint8_t n=0; ; ) {
+			readSn(s, addr, buf + addr - 1, 0x002C - addr);
+			if (addr == 0x0001 && buf[0]) continue;
+			st->RX_RSR = (buf[0x25] << 8) | buf[0x26];
+			st->RX_RD  = (buf[0x27] << 8) | buf[0x28];
+			uint16_t wr = (buf[0x29] << 8) | buf[0x2A];
+			if ((uint16_t)(wr - st->RX_RD) == st->RX_RSR) break;
+			if (n++ > 0 && st->RX_RSR == prev) break;
+			prev = st->RX_RSR;
+		}
+		st->IR = buf[1];
+		st->SR = buf[2];
+		st->TX_FSR = (buf[0x1F] << 8) | buf[0x20];
+		st->TX_WR  = (buf[0x23] << 8) | buf[0x24];
+	}
+	cmdPending &= ~(1 << s);
+	while (st->TX_FSR != txfsr) {
+		txfsr = st->TX_FSR;
+		st->TX_FSR = readSnTX_FSR(s);
+	}
 }
@@ -16,6 +16,7 @@
 
 #include <Arduino.h>
 #include <SPI.h>
+#include "EthernetBus.h"
 
 // Safe for all chips
 #define SPI_ETHERNET_SETTINGS SPISettings(14000000, MSBFIRST, SPI_MODE0)
@@ -27,6 +28,36 @@
 //  the TCP window size & packet loss determine your overall speed.
 //#define SPI_ETHERNET_SETTINGS SPISettings(30000000, MSBFIRST, SPI_MODE0)
 
+// By default the chip type is detected at runtime and every register
+// access dispatches on it.  If your hardware only ever uses one chip,
+// uncomment one of these.  Detection then probes only that chip, the
+// runtime dispatch is removed, and W5500 register accesses are built
+// with a constant control byte.  Smaller and faster, but the other
+// chips are no longer supported.
+//#define ETHERNET_CHIP 51  // W5100
+//#define ETHERNET_CHIP 52  // W5200
+//#define ETHERNET_CHIP 55  // W5500
+
+// Socket mode, ports, destination, protocol and TTL registers are
+// shadowed in RAM (13 bytes per socket) so that rewriting an unchanged
+// value, as every ping or UDP packet to the same host does, costs no
+// SPI traffic.  Uncomment this to save the RAM instead.
+//#define ETHERNET_NO_REGISTER_SHADOW
+
+// The chip is normally driven through the Arduino SPI port, with every
+// access compiled inline.  Uncomment this to go through an EthernetBus
+// object given with W5100.setBus() instead, for DMA, another SPI port
+// or other settings.  Each frame then costs a few virtual calls.  The
+// host build with the chip model (ETHERNET_BUS_MODEL) implies it.
+//#define ETHERNET_CUSTOM_BUS
+
+#if defined(ETHERNET_BUS_MODEL) && !defined(ETHERNET_CUSTOM_BUS)
+#define ETHERNET_CUSTOM_BUS
+#endif
+
+#if defined(ETHERNET_CHIP) && ETHERNET_CHIP != 51 && ETHERNET_CHIP != 52 && ETHERNET_CHIP != 55
+#error "ETHERNET_CHIP must be 51, 52 or 55"
+#endif
 
 // Require Ethernet.h, because we need MAX_SOCK_NUM
 #ifndef ethernet_h_
@@ -127,6 +158,11 @@ class W5100Class {
 
 public:
   static uint8_t init(void);
+  // Probe the chip at once instead of first waiting 560 ms for a reset
+  // pulse to end, see init()
+  static void setFastStart(bool on) { fastStart = on; }
+  // Milliseconds init() spent waiting for and detecting the chip
+  static uint16_t getInitTime(void) { return initTime; }
 
   inline void setGatewayIp(const uint8_t * addr) { writeGAR(addr); }
   inline void getGatewayIp(uint8_t * addr) { readGAR(addr); }
@@ -144,6 +180,18 @@ public:
   inline void setRetransmissionCount(uint8_t retry) { writeRCR(retry); }
 
   static void execCmdSn(SOCKET s, SockCMD _cmd);
+  // Issue a command without waiting for the chip to accept it.  At most
+  // one command per socket is in flight, so the socket number is the
+  // token: the next command, status snapshot or RX_RSR read on this
+  // socket waits for it, or poll cmdSnDone() / wait with cmdSnWait().
+  static void execCmdSnAsync(SOCKET s, SockCMD _cmd);
+  static bool cmdSnDone(SOCKET s);
+  static void cmdSnWait(SOCKET s) {
+    if (s < MAX_SOCK_NUM && (cmdPending & (1 << s))) {
+      while (readSnCR(s)) ;
+      cmdPending &= ~(1 << s);
+    }
+  }
 
 
   // W5100 Registers
@@ -161,31 +209,58 @@ public:
     return data;
   }
 
+private:
+  // W5500 variable length data mode: 16 bit offset, control byte, data.
+  // The control byte selects the block (common, socket n registers,
+  // socket n TX or RX buffer) and the read/write direction.
+  static uint16_t write55(uint16_t offset, uint8_t ctrl, const uint8_t *buf, uint16_t len);
+  static uint16_t read55(uint16_t offset, uint8_t ctrl, uint8_t *buf, uint16_t len);
+
+  // Common register access.  With ETHERNET_CHIP 55 the control byte
+  // is a constant and the address decoding in read()/write() is skipped.
+  static inline uint16_t writeCR(uint16_t addr, const uint8_t *buf, uint16_t len) {
+#if ETHERNET_CHIP == 55
+    return write55(addr, 0x04, buf, len);
+#else
+    return write(addr, buf, len);
+#endif
+  }
+  static inline uint16_t readCR(uint16_t addr, uint8_t *buf, uint16_t len) {
+#if ETHERNET_CHIP == 55
+    return read55(addr, 0x00, buf, len);
+#else
+    return read(addr, buf, len);
+#endif
+  }
+
+public:
 #define __GP_REGISTER8(name, address)             \
   static inline void write##name(uint8_t _data) { \
-    write(address, _data);                        \
+    writeCR(address, &_data, 1);                  \
   }                                               \
   static inline uint8_t read##name() {            \
-    return read(address);                         \
+    uint8_t _data;                                \
+    readCR(address, &_data, 1);                   \
+    return _data;                                 \
   }
 #define __GP_REGISTER16(name, address)            \
   static void write##name(uint16_t _data) {       \
     uint8_t buf[2];                               \
     buf[0] = _data >> 8;                          \
     buf[1] = _data & 0xFF;                        \
-    write(address, buf, 2);                       \
+    writeCR(address, buf, 2);                     \
   }                                               \
   static uint16_t read##name() {                  \
     uint8_t buf[2];                               \
-    read(address, buf, 2);                        \
+    readCR(address, buf, 2);                      \
     return (buf[0] << 8) | buf[1];                \
   }
 #define __GP_REGISTER_N(name, address, size)      \
   static uint16_t write##name(const uint8_t *_buff) {   \
-    return write(address, _buff, size);           \
+    return writeCR(address, _buff, size);         \
   }                                               \
   static uint16_t read##name(uint8_t *_buff) {    \
-    return read(address, _buff, size);            \
+    return readCR(address, _buff, size);          \
   }
   static W5100Linkstatus getLinkStatus();
 
@@ -210,6 +285,9 @@ public:
   __GP_REGISTER8 (VERSIONR_W5500,0x0039);   // Chip Version Register (W5500 only)
   __GP_REGISTER8 (PSTATUS_W5200,     0x0035);    // PHY Status
   __GP_REGISTER8 (PHYCFGR_W5500,     0x002E);    // PHY Configuration register, default: 10111xxx
+  __GP_REGISTER8 (IR2_W5200,  0x0034);    // Socket Interrupt (W5200 only)
+  __GP_REGISTER8 (IMR2_W5200, 0x0036);    // Socket Interrupt Mask (W5200 only)
+  __GP_REGISTER8 (SIR_W5500,  0x0017);    // Socket Interrupt (W5500 only)
 
 
 #undef __GP_REGISTER8
@@ -219,6 +297,13 @@ public:
   // W5100 Socket registers
   // ----------------------
 private:
+#if defined(ETHERNET_CHIP)
+  static uint16_t CH_BASE(void) {
+    if (ETHERNET_CHIP == 55) return 0x1000;
+    if (ETHERNET_CHIP == 52) return 0x4000;
+    return 0x0400;
+  }
+#else
   static uint16_t CH_BASE(void) {
     //if (chip == 55) return 0x1000;
     //if (chip == 52) return 0x4000;
@@ -226,8 +311,27 @@ private:
     return CH_BASE_MSB << 8;
   }
   static uint8_t CH_BASE_MSB; // 1 redundant byte, saves ~80 bytes code on AVR
+#endif
   static const uint16_t CH_SIZE = 0x0100;
 
+#if ETHERNET_CHIP == 55
+  // Socket n register block: BSB = n*4+1, so the control byte is
+  // (n << 5) | 0x08, plus 0x04 for writes
+  static inline uint8_t readSn(SOCKET s, uint16_t addr) {
+    uint8_t data;
+    read55(addr, (s << 5) | 0x08, &data, 1);
+    return data;
+  }
+  static inline uint8_t writeSn(SOCKET s, uint16_t addr, uint8_t data) {
+    return write55(addr, (s << 5) | 0x0C, &data, 1);
+  }
+  static inline uint16_t readSn(SOCKET s, uint16_t addr, uint8_t *buf, uint16_t len) {
+    return read55(addr, (s << 5) | 0x08, buf, len);
+  }
+  static inline uint16_t writeSn(SOCKET s, uint16_t addr, uint8_t *buf, uint16_t len) {
+    return write55(addr, (s << 5) | 0x0C, buf, len);
+  }
+#else
   static inline uint8_t readSn(SOCKET s, uint16_t addr) {
     return read(CH_BASE() + s * CH_SIZE + addr);
   }
@@ -240,6 +344,7 @@ private:
   static inline uint16_t writeSn(SOCKET s, uint16_t addr, uint8_t *buf, uint16_t len) {
     return write(CH_BASE() + s * CH_SIZE + addr, buf, len);
   }
+#endif
 
 #define __SOCKET_REGISTER8(name, address)                    \
   static inline void write##name(SOCKET _s, uint8_t _data) { \
@@ -268,19 +373,78 @@ private:
     return readSn(_s, address, _buff, size);                 \
   }
 
+
+  // Socket configuration registers which are only changed by us (and
+  // by the chip for DIPR/DPORT when a listening socket connects) are
+  // shadowed in RAM.  Writing the value the chip already holds is
+  // skipped without any SPI traffic.
+#ifndef ETHERNET_NO_REGISTER_SHADOW
+  enum {
+    SHADOW_MR    = 0,  // 1 byte
+    SHADOW_PORT  = 1,  // 2 bytes
+    SHADOW_DIPR  = 3,  // 4 bytes
+    SHADOW_DPORT = 7,  // 2 bytes
+    SHADOW_PROTO = 9,  // 1 byte
+    SHADOW_TTL   = 10, // 1 byte
+    SHADOW_SIZE  = 11
+  };
+  typedef struct {
+    uint16_t valid;              // one bit per byte of reg[]
+    uint8_t  reg[SHADOW_SIZE];   // register values, big endian
+  } snshadow_t;
+  static snshadow_t shadow[MAX_SOCK_NUM];
+  static void writeSnShadow(SOCKET s, uint16_t addr, uint8_t slot, const uint8_t *buf, uint8_t len);
+  static void invalidateSnShadow(SOCKET s, uint8_t slot, uint8_t len) {
+    if (s < MAX_SOCK_NUM) shadow[s].valid &= ~(((1 << len) - 1) << slot);
+  }
+#define __SOCKET_SHADOW_WRITE(_s, address, slot, buf, len)   \
+    writeSnShadow(_s, address, SHADOW_##slot, buf, len)
+#else
+#define __SOCKET_SHADOW_WRITE(_s, address, slot, buf, len)   \
+    writeSn(_s, address, buf, len)
+#endif
+
+#define __SOCKET_REGISTER8_SHADOW(name, address, slot)       \
+  static inline void write##name(SOCKET _s, uint8_t _data) { \
+    __SOCKET_SHADOW_WRITE(_s, address, slot, &_data, 1);     \
+  }                                                          \
+  static inline uint8_t read##name(SOCKET _s) {              \
+    return readSn(_s, address);                              \
+  }
+#define __SOCKET_REGISTER16_SHADOW(name, address, slot)      \
+  static void write##name(SOCKET _s, uint16_t _data) {       \
+    uint8_t buf[2];                                          \
+    buf[0] = _data >> 8;                                     \
+    buf[1] = _data & 0xFF;                                   \
+    __SOCKET_SHADOW_WRITE(_s, address, slot, buf, 2);        \
+  }                                                          \
+  static uint16_t read##name(SOCKET _s) {                    \
+    uint8_t buf[2];                                          \
+    readSn(_s, address, buf, 2);                             \
+    return (buf[0] << 8) | buf[1];                           \
+  }
+#define __SOCKET_REGISTER_N_SHADOW(name, address, size, slot) \
+  static uint16_t write##name(SOCKET _s, uint8_t *_buff) {   \
+    __SOCKET_SHADOW_WRITE(_s, address, slot, _buff, size);   \
+    return size;                                             \
+  }                                                          \
+  static uint16_t read##name(SOCKET _s, uint8_t *_buff) {    \
+    return readSn(_s, address, _buff, size);                 \
+  }
+
 public:
-  __SOCKET_REGISTER8(SnMR,        0x0000)        // Mode
+  __SOCKET_REGISTER8_SHADOW(SnMR, 0x0000, MR)    // Mode
   __SOCKET_REGISTER8(SnCR,        0x0001)        // Command
   __SOCKET_REGISTER8(SnIR,        0x0002)        // Interrupt
   __SOCKET_REGISTER8(SnSR,        0x0003)        // Status
-  __SOCKET_REGISTER16(SnPORT,     0x0004)        // Source Port
+  __SOCKET_REGISTER16_SHADOW(SnPORT, 0x0004, PORT) // Source Port
   __SOCKET_REGISTER_N(SnDHAR,     0x0006, 6)     // Destination Hardw Addr
-  __SOCKET_REGISTER_N(SnDIPR,     0x000C, 4)     // Destination IP Addr
-  __SOCKET_REGISTER16(SnDPORT,    0x0010)        // Destination Port
+  __SOCKET_REGISTER_N_SHADOW(SnDIPR, 0x000C, 4, DIPR) // Destination IP Addr
+  __SOCKET_REGISTER16_SHADOW(SnDPORT, 0x0010, DPORT)  // Destination Port
   __SOCKET_REGISTER16(SnMSSR,     0x0012)        // Max Segment Size
-  __SOCKET_REGISTER8(SnPROTO,     0x0014)        // Protocol in IP RAW Mode
+  __SOCKET_REGISTER8_SHADOW(SnPROTO, 0x0014, PROTO) // Protocol in IP RAW Mode
   __SOCKET_REGISTER8(SnTOS,       0x0015)        // IP TOS
-  __SOCKET_REGISTER8(SnTTL,       0x0016)        // IP TTL
+  __SOCKET_REGISTER8_SHADOW(SnTTL, 0x0016, TTL)  // IP TTL
   __SOCKET_REGISTER8(SnRX_SIZE,   0x001E)        // RX Memory Size (W5200 only)
   __SOCKET_REGISTER8(SnTX_SIZE,   0x001F)        // RX Memory Size (W5200 only)
   __SOCKET_REGISTER16(SnTX_FSR,   0x0020)        // TX Free Size
@@ -290,50 +454,136 @@ public:
   __SOCKET_REGISTER16(SnRX_RD,    0x0028)        // RX Read Pointer
   __SOCKET_REGISTER16(SnRX_WR,    0x002A)        // RX Write Pointer (supported?)
 
+  // Sn_DIPR and Sn_DPORT are adjacent, so set the destination with a
+  // single burst write instead of two (or three) framed transfers
+  static void writeSnDEST(SOCKET _s, const uint8_t *addr, uint16_t port) {
+    uint8_t buf[6];
+    memcpy(buf, addr, 4);
+    buf[4] = port >> 8;
+    buf[5] = port & 0xFF;
+    __SOCKET_SHADOW_WRITE(_s, 0x000C, DIPR, buf, 6);
+  }
+
+  // Snapshot of the registers polled while moving data.  txfsr is the
+  // last Sn_TX_FSR value the caller knows of, see readSnStatus().
+  typedef struct {
+    uint8_t  IR;     // Interrupt
+    uint8_t  SR;     // Status
+    uint16_t TX_FSR; // TX Free Size
+    uint16_t TX_WR;  // TX Write Pointer
+    uint16_t RX_RSR; // RX Received Size
+    uint16_t RX_RD;  // RX Read Pointer
+  } snstatus_t;
+  static void readSnStatus(SOCKET s, snstatus_t *st, uint16_t txfsr);
+  static uint16_t readSnRX_RSRStable(SOCKET s);
+
+  // RAM table of every socket's status.  scanSockets() reads the common
+  // socket interrupt register (IR2 on W5200, SIR on W5500) and re-reads
+  // Sn_SR and Sn_IR only for sockets which signalled, or whose status can
+  // change without an interrupt.  Sn_IR's CON, DISCON and RECV bits are
+  // moved into the table, see getSnEvents().  Fills status[] and returns
+  // a bitmask of the sockets which signalled.
+  static uint8_t scanSockets(uint8_t *status);
+  static uint8_t getSnEvents(SOCKET s) { return sockIR[s]; }
+  static void clearSnEvents(SOCKET s, uint8_t mask) { sockIR[s] &= ~mask; }
+  // Forget the table's status of a socket whose Sn_IR was cleared
+  // elsewhere, so the next scanSockets() reads Sn_SR again
+  static void invalidateSnSR(SOCKET s) { if (s < MAX_SOCK_NUM) sockSR[s] = 0xFF; }
+
 #undef __SOCKET_REGISTER8
 #undef __SOCKET_REGISTER16
 #undef __SOCKET_REGISTER_N
+#undef __SOCKET_REGISTER8_SHADOW
+#undef __SOCKET_REGISTER16_SHADOW
+#undef __SOCKET_REGISTER_N_SHADOW
+#undef __SOCKET_SHADOW_WRITE
 
 
 private:
   static uint8_t chip;
+  static uint8_t cmdPending; // one bit per socket with a command in flight
+  static uint8_t sockSR[MAX_SOCK_NUM]; // 0xFF = unknown, re-read on scan
+  static uint8_t sockIR[MAX_SOCK_NUM];
+  static bool sockSRStable(uint8_t sr);
+  static bool fastStart;
+  static uint16_t initTime;
+  static uint8_t probe(void);
+  static uint8_t txbufsize[MAX_SOCK_NUM]; // in KB
+  static uint8_t rxbufsize[MAX_SOCK_NUM];
+  static void writeBufSizes(void);
+  static uint8_t log2kb(uint8_t kb);
   static uint8_t ss_pin;
   static uint8_t softReset(void);
   static uint8_t isW5100(void);
   static uint8_t isW5200(void);
   static uint8_t isW5500(void);
 
+  // True if the chip in use is the given one.  With ETHERNET_CHIP this
+  // is a compile time constant, so the code for other chips is dropped.
+#if defined(ETHERNET_CHIP)
+  static constexpr bool chipIs(uint8_t c) { return c == ETHERNET_CHIP; }
+#else
+  static inline bool chipIs(uint8_t c) { return chip == c; }
+#endif
+
 public:
   static uint8_t getChip(void) { return chip; }
-#ifdef ETHERNET_LARGE_BUFFERS
-  static uint16_t SSIZE;
-  static uint16_t SMASK;
+
+  // Socket buffer sizes, set up by init() and changed by setSnBufSize()
+  static uint16_t TXSIZE(SOCKET s) { return (uint16_t)txbufsize[s] << 10; }
+  static uint16_t RXSIZE(SOCKET s) { return (uint16_t)rxbufsize[s] << 10; }
+  static bool setSnBufSize(SOCKET s, uint8_t txkb, uint8_t rxkb);
+  static uint16_t SBASE(uint8_t socknum);
+  static uint16_t RBASE(uint8_t socknum);
+
+  // Socket buffer access by the chip's free running RX_RD / TX_WR
+  // pointers, wrapping around the end of the buffer as needed
+  static void readSnRX(SOCKET s, uint16_t ptr, uint8_t *buf, uint16_t len);
+  static void writeSnTX(SOCKET s, uint16_t ptr, const uint8_t *buf, uint16_t len);
+
+  static void setSS(uint8_t pin) { ss_pin = pin; }
+
+  // Claim the bus around a group of chip accesses.  Every register or
+  // buffer access must be made inside a transaction.
+  inline static void beginTransaction() {
+#ifdef ETHERNET_CUSTOM_BUS
+	bus->beginTransaction();
 #else
-  static const uint16_t SSIZE = 2048;
-  static const uint16_t SMASK = 0x07FF;
+	SPI.beginTransaction(SPI_ETHERNET_SETTINGS);
 #endif
-  static uint16_t SBASE(uint8_t socknum) {
-    if (chip == 51) {
-      return socknum * SSIZE + 0x4000;
-    } else {
-      return socknum * SSIZE + 0x8000;
-    }
   }
-  static uint16_t RBASE(uint8_t socknum) {
-    if (chip == 51) {
-      return socknum * SSIZE + 0x6000;
-    } else {
-      return socknum * SSIZE + 0xC000;
-    }
+  inline static void endTransaction() {
+#ifdef ETHERNET_CUSTOM_BUS
+	bus->endTransaction();
+#else
+	SPI.endTransaction();
+#endif
   }
 
-  static bool hasOffsetAddressMapping(void) {
-    if (chip == 55) return true;
-    return false;
-  }
-  static void setSS(uint8_t pin) { ss_pin = pin; }
+#ifdef ETHERNET_CUSTOM_BUS
+  // Talk to the chip through another transport than the SPI port
+  static void setBus(EthernetBus *b) { bus = b; }
 
 private:
+  static EthernetBus *bus;
+  inline static void busBegin() { bus->begin(); }
+  inline static void busSelect() { bus->select(); }
+  inline static void busDeselect() { bus->deselect(); }
+  inline static void busTransfer(const uint8_t *txbuf, uint8_t *rxbuf, uint16_t len) {
+	bus->transfer(txbuf, rxbuf, len);
+  }
+#else
+private:
+  inline static void busBegin() { spiBegin(); }
+  inline static void busSelect() { setSS(); }
+  inline static void busDeselect() { resetSS(); }
+  inline static void busTransfer(const uint8_t *txbuf, uint8_t *rxbuf, uint16_t len) {
+	spiTransfer(txbuf, rxbuf, len);
+  }
+#endif
+  static void spiBegin();
+  static void spiTransfer(const uint8_t *txbuf, uint8_t *rxbuf, uint16_t len);
+  friend class EthernetSPIBus;
 #if defined(__AVR__)
 	static volatile uint8_t *ss_pin_reg;
 	static uint8_t ss_pin_mask;
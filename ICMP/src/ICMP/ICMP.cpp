@@ -34,7 +34,10 @@ uint8_t ICMP::socketBegin(const SOCKET _socketNo) {
 #if (ICMP_DEBUG > 1)
     Serial.println(F("Socket begin... "));
 #endif
-    SPI.beginTransaction(SPI_ETHERNET_SETTINGS);
+    // Socket must not be used by Ethernet client, server or UDP at same time
+    if (!Ethernet.socketReserve(_socketNo)) { return rc; }
+
+    W5100.beginTransaction();
     // All socket activity will be canceled
     W5100.execCmdSn(_socketNo, Sock_CLOSE);
     W5100.writeSnIR(_socketNo, 0xFF);
@@ -48,7 +51,7 @@ uint8_t ICMP::socketBegin(const SOCKET _socketNo) {
       rc = (SnSR::IPRAW == W5100.readSnSR(_socketNo));  
       yield();
     }
-    SPI.endTransaction();
+    W5100.endTransaction();
     
     if (rc) {
       // All OK, socket can be used
@@ -62,14 +65,17 @@ uint8_t ICMP::socketBegin(const SOCKET _socketNo) {
 
 void ICMP::socketClose(const SOCKET _socketNo) {
 
+    if (WRONG_SOCKET_NO == _socketNo) { return; }
+
 #if (ICMP_DEBUG > 1)
     Serial.println(F("Socket close"));
 #endif
-    SPI.beginTransaction(SPI_ETHERNET_SETTINGS);
+    W5100.beginTransaction();
     W5100.execCmdSn(_socketNo, Sock_CLOSE);
     W5100.writeSnIR(_socketNo, 0xFF);
     socketNo = WRONG_SOCKET_NO;
-    SPI.endTransaction();
+    W5100.endTransaction();
+    Ethernet.socketRelease(_socketNo);
 }
 
 void ICMP::initChecksum() {
@@ -150,36 +156,39 @@ icmpStatus_t ICMP::sendPacket(const uint8_t _packetType, const IPAddress& _desti
     Serial.println();
 #endif
 
-    SPI.beginTransaction(SPI_ETHERNET_SETTINGS);
-    W5100.writeSnDIPR(socketNo, addri);
-    W5100.writeSnTTL(socketNo, _ttl);
+    W5100.beginTransaction();
     // The port isn't used, becuause ICMP is a network-layer protocol. So we
-    // write zero. This probably isn't actually necessary.
-    W5100.writeSnDPORT(socketNo, 0x00);
-    // Write to socket packet header first
-    write_data(socketNo, 0x00, (uint8_t*)&packet.icmp, sizeof(packet.icmp));
-    // Add external payload 
-    write_data(socketNo, sizeof(packet.icmp), packet.icmpPayload, payloadBufferSize);
+    // write zero. This probably isn't actually necessary, but DIPR and DPORT
+    // are written in one frame anyway.
+    W5100.writeSnDEST(socketNo, addri, 0x00);
+    W5100.writeSnTTL(socketNo, _ttl);
+    // Socket packet header, then external payload right behind it, with
+    // one TX_WR read and update for both
+    const socket_iov_t iov[] = {
+        { (const uint8_t*)&packet.icmp, sizeof(packet.icmp) },
+        { packet.icmpPayload, payloadBufferSize }
+    };
+    write_datav(socketNo, 0x00, iov, 0x02);
     // Send data
     W5100.execCmdSn(socketNo, Sock_SEND);
-    SPI.endTransaction();
+    W5100.endTransaction();
 
     // No system timeout used
     // SnIR is always have SEND_OK bit if sending will be OK once in current session
     // Socket must be re-opened to proper diagnostic
 
     while(STATUS_NONE == rc) {
-      SPI.beginTransaction(SPI_ETHERNET_SETTINGS);
+      W5100.beginTransaction();
       uint8_t valueSnIR = W5100.readSnIR(socketNo);
-      SPI.endTransaction();
+      W5100.endTransaction();
       if (SnIR::TIMEOUT == (valueSnIR & SnIR::TIMEOUT)) { rc = STATUS_SEND_TIMEOUT; }
       if (SnIR::SEND_OK == (valueSnIR & SnIR::SEND_OK)) { rc = STATUS_SUCCESS; }
       yield();
     }
 
-    SPI.beginTransaction(SPI_ETHERNET_SETTINGS);
+    W5100.beginTransaction();
     W5100.writeSnIR(socketNo, (SnIR::SEND_OK | SnIR::TIMEOUT));
-    SPI.endTransaction();
+    W5100.endTransaction();
     return rc;
 }
 
@@ -189,18 +198,18 @@ icmpStatus_t ICMP::receivePacketProcessing() {
 
   icmpStatus_t rc = STATUS_RECIEVE_PROCESSING;
 
-  SPI.beginTransaction(SPI_ETHERNET_SETTINGS);
+  W5100.beginTransaction();
   uint16_t bytesAvailable = getSnRX_RSR(socketNo);
-  SPI.endTransaction();
+  W5100.endTransaction();
    
   switch (processingStage) {
     case psHandleIpPacketInfo: {
       // Not enough data 
       if (bytesAvailable < sizeof(packet.info)) { yield(); break; }
       // Fetch IP packet info data
-      SPI.beginTransaction(SPI_ETHERNET_SETTINGS);
+      W5100.beginTransaction();
       read_data(socketNo, recieveBufferAddr, (uint8_t*)&packet.info, sizeof(packet.info));
-      SPI.endTransaction();
+      W5100.endTransaction();
       // Next reading begins from 0x00 + size of IP packet info 
       recieveBufferAddr += sizeof(packet.info);
 
@@ -223,9 +232,9 @@ icmpStatus_t ICMP::receivePacketProcessing() {
       if (bytesAvailable < needWaiForBytesNum) { yield(); break; }
 
       // Fetch ICMP prefix data
-      SPI.beginTransaction(SPI_ETHERNET_SETTINGS);
+      W5100.beginTransaction();
       read_data(socketNo, recieveBufferAddr, (uint8_t*)&packet.icmp, sizeof(packet.icmp));
-      SPI.endTransaction();
+      W5100.endTransaction();
       recieveBufferAddr += sizeof(packet.icmp);
 
 #if (ICMP_DEBUG > 2)
@@ -247,9 +256,9 @@ icmpStatus_t ICMP::receivePacketProcessing() {
       uint16_t fetchPayloadSize = (packet.info.icmpPayloadSize > payloadBufferSize) ? payloadBufferSize : packet.info.icmpPayloadSize;
 
       // Fetch ICMP payload data
-      SPI.beginTransaction(SPI_ETHERNET_SETTINGS);
+      W5100.beginTransaction();
       read_data(socketNo, recieveBufferAddr, packet.icmpPayload, fetchPayloadSize);
-      //SPI.endTransaction();
+      //W5100.endTransaction();
       recieveBufferAddr += fetchPayloadSize;
 
       // calc checksum for fetched payload
@@ -257,7 +266,7 @@ icmpStatus_t ICMP::receivePacketProcessing() {
 
       // When incoming payload very big - we do not recieve it, and just calc CRC 
       if (packet.info.icmpPayloadSize > payloadBufferSize) {
-         //SPI.beginTransaction(SPI_ETHERNET_SETTINGS);
+         //W5100.beginTransaction();
          uint16_t restPayloadSize = packet.info.icmpPayloadSize - payloadBufferSize;
          for (uint16_t i = 0x00; restPayloadSize > i; i += 0x02) {
              uint8_t fetchData[0x02] = {0x00, 0x00};
@@ -265,17 +274,17 @@ icmpStatus_t ICMP::receivePacketProcessing() {
              addChecksum(fetchData[0x00], fetchData[0x01]);     
              recieveBufferAddr += sizeof(fetchData);
          }
-         //SPI.endTransaction();
+         //W5100.endTransaction();
       }
 
-      //SPI.beginTransaction(SPI_ETHERNET_SETTINGS);
+      //W5100.beginTransaction();
       // Mark all data as readed
       W5100.writeSnRX_RD(socketNo, bytesAvailable);
       W5100.execCmdSn(socketNo, Sock_RECV);
       // It is set as 1 whenever W5100 receives data. And it is also set as 1 if received data remains after execute CMD_RECV command. 
       W5100.writeSnIR(socketNo, SnIR::RECV);
       packet.ttl = W5100.readSnTTL(socketNo);
-      SPI.endTransaction();
+      W5100.endTransaction();
 
       packet.icmp.checksum = endChecksum();
       packet.icmp.id       = __htons(packet.icmp.id);
@@ -297,9 +306,9 @@ icmpStatus_t ICMP::receivingStart() {
 
   processingStage = psHandleIpPacketInfo; 
   memset(packet.icmpPayload, 0x00, payloadBufferSize);
-  SPI.beginTransaction(SPI_ETHERNET_SETTINGS);
+  W5100.beginTransaction();
   recieveBufferAddr = W5100.readSnRX_RD(socketNo);
-  SPI.endTransaction();
+  W5100.endTransaction();
 
 #if (ICMP_DEBUG > 1)
   Serial.println(F("\nRecieving packet"));